@@ -0,0 +1,663 @@
+/*
+ * apu.c
+ * by Max Willsey
+ * the audio processing unit: two pulse waves, a triangle, noise and dmc
+ */
+
+#include <math.h>
+#include <pthread.h>
+
+#include "nes.h"
+
+/* the apu runs lazily like the ppu. It only catches up to the cpu when a
+ * register is touched, when it might raise an irq (its deadline), and at
+ * the end of every frame.
+ *
+ * rather than stepping every cycle, it jumps straight to the next cycle
+ * anything happens: a channel's timer running out or the frame counter.
+ * whenever that changes the mixed output, a band limited step is added
+ * into buf at that exact time. Summing buf gives samples at the output
+ * rate with no aliasing, so nothing runs at the cpu's 1.79 MHz */
+
+#define CPU_HZ 1789773.0
+
+/* timer value for a channel that can't change its output right now */
+#define IDLE (1 << 20)
+
+/* samples of steps to hold between flushes, and the steps' shape */
+#define BUF_SIZE    4096
+#define BLIP_TAPS   16
+#define BLIP_PHASES 32
+
+/* dynamic rate control can stretch the output by this much either way to
+ * keep the ring at its target */
+#define MAX_DRIFT 0.005
+
+static const byte length_table[32] = {
+  10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+  12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const byte duty_table[4][8] = {
+  {0, 1, 0, 0, 0, 0, 0, 0},
+  {0, 1, 1, 0, 0, 0, 0, 0},
+  {0, 1, 1, 1, 1, 0, 0, 0},
+  {1, 0, 0, 1, 1, 1, 1, 1}
+};
+
+static const byte triangle_table[32] = {
+  15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+/* in cpu cycles, for NTSC */
+static const uint16_t noise_periods[16] = {
+  4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const uint16_t dmc_periods[16] = {
+  428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+/* cycles of each frame counter step after it's reset, and the length of
+ * the whole sequence, in 4 and 5 step mode */
+static const int frame_times[2][5] = {
+  {7457, 14913, 22371, 29829},
+  {7457, 14913, 22371, 29829, 37281}
+};
+static const int frame_length[2] = {29830, 37282};
+
+/* the mixer isn't linear, these are its two halves. They're shared by
+ * every machine, so they're made once even with machines on many threads */
+static float pulse_mix[31], tnd_mix[203];
+static float kernel[BLIP_PHASES][BLIP_TAPS];
+static pthread_once_t tables_made = PTHREAD_ONCE_INIT;
+
+static void make_tables (void) {
+  double x, w, sum;
+  int i, p, k;
+
+  for (i = 1; i < 31; i++)
+    pulse_mix[i] = 95.52 / (8128.0 / i + 100);
+  for (i = 1; i < 203; i++)
+    tnd_mix[i] = 163.67 / (24329.0 / i + 100);
+
+  /* each phase is a blackman windowed sinc, cut off a bit below nyquist,
+   * for a step that far between two samples. they sum to 1 so a step
+   * integrates to exactly its height */
+  for (p = 0; p < BLIP_PHASES; p++) {
+    sum = 0;
+    for (k = 0; k < BLIP_TAPS; k++) {
+      x = k - (BLIP_TAPS / 2 - 1) - (double) p / BLIP_PHASES;
+      w = (x + BLIP_TAPS / 2) / BLIP_TAPS;
+      kernel[p][k] = (x == 0 ? 1 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x)) *
+        (0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w));
+      sum += kernel[p][k];
+    }
+    for (k = 0; k < BLIP_TAPS; k++)
+      kernel[p][k] /= sum;
+  }
+}
+
+/*** output ***/
+
+/* add a step of delta at the current cycle */
+static void add_step (apu *a, float delta) {
+  double pos = a->buf_offset + (a->clock - a->buf_clock) * a->ratio;
+  int i = pos;
+  float *k = kernel[(int) ((pos - i) * BLIP_PHASES)];
+  float *b = a->buf + i;
+  int j;
+
+  for (j = 0; j < BLIP_TAPS; j++)
+    b[j] += delta * k[j];
+}
+
+/* samples of buf finished so far */
+static int buf_pending (apu *a) {
+  return a->buf_offset + (a->clock - a->buf_clock) * a->ratio;
+}
+
+/* turn the finished samples into sound and put them in the ring. If it's
+ * full, they're dropped */
+static void flush (apu *a) {
+  double end = a->buf_offset + (a->clock - a->buf_clock) * a->ratio;
+  int count = end, i, s;
+  unsigned head = atomic_load_explicit(&a->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&a->tail, memory_order_acquire);
+
+  for (i = 0; i < count; i++) {
+    a->sum += a->buf[i];
+    /* block dc, the mixer's output never goes negative */
+    a->hp_out = a->sum - a->hp_in + 0.999f * a->hp_out;
+    a->hp_in = a->sum;
+    s = a->hp_out * 30000;
+    s = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+    if (head - tail < a->ring_size)
+      a->ring[head++ & (a->ring_size - 1)] = s;
+  }
+  atomic_store_explicit(&a->head, head, memory_order_release);
+
+  /* the tail of the last steps moves to the front */
+  memmove(a->buf, a->buf + count, BLIP_TAPS * sizeof(float));
+  memset(a->buf + BLIP_TAPS, 0, count * sizeof(float));
+  a->buf_clock = a->clock;
+  a->buf_offset = end - count;
+}
+
+/*** channels ***/
+
+static int sweep_target (apu_channel *ch, bit first) {
+  int change = ch->raw_period >> ch->sweep_shift;
+  if (ch->sweep_negate)
+    return ch->raw_period - change - first;
+  return ch->raw_period + change;
+}
+
+static bit pulse_muted (apu_channel *ch, bit first) {
+  return ch->raw_period < 8 || sweep_target(ch, first) > 0x7ff;
+}
+
+static byte envelope (apu_channel *ch) {
+  return ch->constant ? ch->volume : ch->env_decay;
+}
+
+static byte pulse_out (apu_channel *ch, bit first) {
+  if (!ch->length || pulse_muted(ch, first) || !duty_table[ch->duty][ch->step])
+    return 0;
+  return envelope(ch);
+}
+
+/* a timer that was idle starts counting again */
+static void wake (apu_channel *ch) {
+  if (ch->timer > ch->period)
+    ch->timer = ch->period;
+}
+
+static void pulse_period (apu_channel *ch) {
+  ch->period = ch->raw_period < 8 ? IDLE : (ch->raw_period + 1) * 2;
+  wake(ch);
+}
+
+static void triangle_period (apu_channel *ch) {
+  /* periods this short are ultrasonic, so it may as well hold still */
+  ch->period = ch->raw_period < 2 ? IDLE : ch->raw_period + 1;
+  wake(ch);
+}
+
+/* these run when a channel's timer runs out. Silent channels sleep until
+ * something wakes them */
+static void pulse_clock (apu_channel *ch) {
+  ch->step = (ch->step + 1) & 7;
+  ch->timer = ch->length ? ch->period : IDLE;
+}
+
+static void triangle_clock (apu_channel *ch) {
+  if (ch->length && ch->linear) {
+    ch->step = (ch->step + 1) & 31;
+    ch->timer = ch->period;
+  } else {
+    ch->timer = IDLE;
+  }
+}
+
+static void noise_clock (apu_channel *ch) {
+  int feedback = (ch->lfsr ^ (ch->lfsr >> (ch->mode ? 6 : 1))) & 1;
+  ch->lfsr = (ch->lfsr >> 1) | (feedback << 14);
+  ch->timer = ch->length ? ch->period : IDLE;
+}
+
+/* the dmc reads the next byte of its sample as soon as its buffer is
+ * empty, stalling the cpu while it does */
+static void dmc_fetch (nes *n) {
+  apu *a = n->a;
+  apu_dmc *d = &a->dmc;
+
+  if (d->buffer_full || !d->remaining)
+    return;
+  d->buffer = mem_read(n->c->mem, d->address);
+  d->buffer_full = 1;
+  d->address = d->address == 0xffff ? 0x8000 : d->address + 1;
+  n->c->cycles += 4;
+  if (--d->remaining == 0) {
+    if (d->loop) {
+      d->address = d->start;
+      d->remaining = d->length;
+    } else if (d->irq_enabled) {
+      a->dmc_irq = 1;
+      n->c->irq |= IRQ_DMC;
+    }
+  }
+}
+
+static void dmc_clock (nes *n) {
+  apu_dmc *d = &n->a->dmc;
+
+  if (!d->silence) {
+    if (d->shift & 1) {
+      if (d->level <= 125)
+        d->level += 2;
+    } else if (d->level >= 2) {
+      d->level -= 2;
+    }
+    d->shift >>= 1;
+  }
+  if (--d->bits == 0) {
+    d->bits = 8;
+    d->silence = !d->buffer_full;
+    d->shift = d->buffer;
+    d->buffer_full = 0;
+    dmc_fetch(n);
+  }
+  d->timer = d->period;
+}
+
+/*** frame counter ***/
+
+static void envelope_clock (apu_channel *ch) {
+  if (ch->env_start) {
+    ch->env_start = 0;
+    ch->env_decay = 15;
+    ch->env_divider = ch->volume;
+  } else if (ch->env_divider) {
+    ch->env_divider--;
+  } else {
+    ch->env_divider = ch->volume;
+    if (ch->env_decay)
+      ch->env_decay--;
+    else if (ch->halt)
+      ch->env_decay = 15;
+  }
+}
+
+static void quarter_frame (apu *a) {
+  apu_channel *t = &a->triangle;
+
+  envelope_clock(&a->pulse[0]);
+  envelope_clock(&a->pulse[1]);
+  envelope_clock(&a->noise);
+  if (t->linear_start)
+    t->linear = t->linear_reload;
+  else if (t->linear)
+    t->linear--;
+  if (!t->halt)
+    t->linear_start = 0;
+}
+
+static void length_clock (apu_channel *ch) {
+  if (!ch->halt && ch->length)
+    ch->length--;
+}
+
+static void sweep_clock (apu_channel *ch, bit first) {
+  if (!ch->sweep_divider && ch->sweep_enabled && ch->sweep_shift &&
+      !pulse_muted(ch, first)) {
+    ch->raw_period = sweep_target(ch, first);
+    pulse_period(ch);
+  }
+  if (!ch->sweep_divider || ch->sweep_reload) {
+    ch->sweep_divider = ch->sweep_period;
+    ch->sweep_reload = 0;
+  } else {
+    ch->sweep_divider--;
+  }
+}
+
+static void half_frame (apu *a) {
+  length_clock(&a->pulse[0]);
+  length_clock(&a->pulse[1]);
+  length_clock(&a->triangle);
+  length_clock(&a->noise);
+  sweep_clock(&a->pulse[0], 1);
+  sweep_clock(&a->pulse[1], 0);
+}
+
+static void wake_all (apu *a) {
+  wake(&a->pulse[0]);
+  wake(&a->pulse[1]);
+  wake(&a->triangle);
+  wake(&a->noise);
+}
+
+static void frame_clock (nes *n) {
+  apu *a = n->a;
+  int mode = a->five_step, k = a->frame_step;
+
+  if (k != 3 || !mode)
+    quarter_frame(a);
+  if (k == 1 || k == 3 + mode)
+    half_frame(a);
+  if (k == 3 && !mode && !a->irq_inhibit) {
+    a->frame_irq = 1;
+    n->c->irq |= IRQ_FRAME;
+  }
+  wake_all(a);
+
+  if (k < 3 + mode) {
+    a->frame_timer = frame_times[mode][k + 1] - frame_times[mode][k];
+    a->frame_step++;
+  } else {
+    a->frame_timer = frame_length[mode] - frame_times[mode][k] +
+      frame_times[mode][0];
+    a->frame_step = 0;
+  }
+}
+
+/*** running ***/
+
+/* work out the output and add a step if it changed */
+static void mix (apu *a) {
+  apu_channel *nz = &a->noise;
+  int p = pulse_out(&a->pulse[0], 1) + pulse_out(&a->pulse[1], 0);
+  int t = triangle_table[a->triangle.step];
+  int r = nz->length && !(nz->lfsr & 1) ? envelope(nz) : 0;
+  float level = pulse_mix[p] + tnd_mix[3 * t + 2 * r + a->dmc.level];
+
+  if (level != a->level) {
+    if (a->rate)
+      add_step(a, level - a->level);
+    a->level = level;
+  }
+}
+
+/* the cpu needs a look in by the next frame counter step, or when the dmc
+ * fetches the last byte of a sample that ends in an irq */
+static void set_deadline (apu *a) {
+  apu_dmc *d = &a->dmc;
+  uint64_t end;
+
+  a->deadline = a->clock + a->frame_timer;
+  if (d->irq_enabled && d->remaining && !d->loop) {
+    end = a->clock + d->timer +
+      (uint64_t) d->period * (d->bits - 1 + 8 * (d->remaining - 1));
+    if (end < a->deadline)
+      a->deadline = end;
+  }
+}
+
+static void apu_run (nes *n, uint64_t until) {
+  apu *a = n->a;
+  int step;
+
+  while (a->clock < until) {
+    step = until - a->clock < (uint64_t) a->frame_timer ?
+      (int) (until - a->clock) : a->frame_timer;
+    if (a->pulse[0].timer < step) step = a->pulse[0].timer;
+    if (a->pulse[1].timer < step) step = a->pulse[1].timer;
+    if (a->triangle.timer < step) step = a->triangle.timer;
+    if (a->noise.timer < step) step = a->noise.timer;
+    if (a->dmc.timer < step) step = a->dmc.timer;
+
+    a->clock += step;
+    a->frame_timer -= step;
+    a->pulse[0].timer -= step;
+    a->pulse[1].timer -= step;
+    a->triangle.timer -= step;
+    a->noise.timer -= step;
+    a->dmc.timer -= step;
+
+    if (!a->pulse[0].timer) pulse_clock(&a->pulse[0]);
+    if (!a->pulse[1].timer) pulse_clock(&a->pulse[1]);
+    if (!a->triangle.timer) triangle_clock(&a->triangle);
+    if (!a->noise.timer) noise_clock(&a->noise);
+    if (!a->dmc.timer) dmc_clock(n);
+    if (!a->frame_timer) frame_clock(n);
+    mix(a);
+
+    if (a->rate && buf_pending(a) > BUF_SIZE / 2)
+      flush(a);
+  }
+}
+
+/* run up to where the cpu is */
+void apu_catch_up (nes *n) {
+  PROF_ENTER(n, PROF_APU);
+  apu_run(n, n->c->cycles);
+  set_deadline(n->a);
+  PROF_LEAVE(n);
+}
+
+/* the end of a video frame, send what's been made so far to the ring */
+void apu_end_frame (nes *n) {
+  apu *a = n->a;
+  double error;
+
+  apu_catch_up(n);
+  if (!a->rate)
+    return;
+  PROF_ENTER(n, PROF_APU);
+  flush(a);
+
+  /* dynamic rate control: make a little less when the ring is fuller than
+   * we want, a little more when it's emptier. Whatever clock is pacing the
+   * frames, the sound card then never runs dry or falls behind */
+  error = ((double) apu_queued(a) - a->target) / a->target;
+  error = error > 1 ? 1 : error < -1 ? -1 : error;
+  a->ratio = a->rate / CPU_HZ * (1 - MAX_DRIFT * error);
+  PROF_LEAVE(n);
+}
+
+/*** registers ***/
+
+static void channel_control (apu_channel *ch, byte b) {
+  ch->halt = b & 0x20;
+  ch->constant = b & 0x10;
+  ch->volume = b & 0x0f;
+}
+
+static void load_length (apu_channel *ch, byte b) {
+  if (ch->enabled)
+    ch->length = length_table[b >> 3];
+}
+
+/* $4015 */
+byte apu_read (nes *n, addr reg) {
+  apu *a = n->a;
+  byte b = 0;
+
+  if (reg != 0x4015)
+    return 0;
+  apu_catch_up(n);
+  b |= a->pulse[0].length ? 0x01 : 0;
+  b |= a->pulse[1].length ? 0x02 : 0;
+  b |= a->triangle.length ? 0x04 : 0;
+  b |= a->noise.length ? 0x08 : 0;
+  b |= a->dmc.remaining ? 0x10 : 0;
+  b |= a->frame_irq ? 0x40 : 0;
+  b |= a->dmc_irq ? 0x80 : 0;
+  /* reading acknowledges the frame irq */
+  a->frame_irq = 0;
+  n->c->irq &= ~IRQ_FRAME;
+  return b;
+}
+
+/* $4000-$4013, $4015 and $4017 */
+void apu_write (nes *n, addr reg, byte b) {
+  apu *a = n->a;
+  apu_channel *ch = &a->pulse[(reg >> 2) & 1];
+  apu_dmc *d = &a->dmc;
+  int i;
+
+  apu_catch_up(n);
+  switch (reg) {
+  case 0x4000:
+  case 0x4004:
+    ch->duty = b >> 6;
+    channel_control(ch, b);
+    break;
+  case 0x4001:
+  case 0x4005:
+    ch->sweep_enabled = b & 0x80;
+    ch->sweep_period = (b >> 4) & 7;
+    ch->sweep_negate = b & 0x08;
+    ch->sweep_shift = b & 7;
+    ch->sweep_reload = 1;
+    break;
+  case 0x4002:
+  case 0x4006:
+    ch->raw_period = (ch->raw_period & 0x700) | b;
+    pulse_period(ch);
+    break;
+  case 0x4003:
+  case 0x4007:
+    ch->raw_period = (ch->raw_period & 0xff) | (b & 7) << 8;
+    load_length(ch, b);
+    ch->step = 0;
+    ch->env_start = 1;
+    pulse_period(ch);
+    break;
+
+  case 0x4008:
+    a->triangle.halt = b & 0x80;
+    a->triangle.linear_reload = b & 0x7f;
+    break;
+  case 0x400a:
+    a->triangle.raw_period = (a->triangle.raw_period & 0x700) | b;
+    triangle_period(&a->triangle);
+    break;
+  case 0x400b:
+    a->triangle.raw_period = (a->triangle.raw_period & 0xff) | (b & 7) << 8;
+    load_length(&a->triangle, b);
+    a->triangle.linear_start = 1;
+    triangle_period(&a->triangle);
+    break;
+
+  case 0x400c:
+    channel_control(&a->noise, b);
+    break;
+  case 0x400e:
+    a->noise.mode = b & 0x80;
+    a->noise.period = noise_periods[b & 0x0f];
+    wake(&a->noise);
+    break;
+  case 0x400f:
+    load_length(&a->noise, b);
+    a->noise.env_start = 1;
+    wake(&a->noise);
+    break;
+
+  case 0x4010:
+    d->irq_enabled = b & 0x80;
+    d->loop = b & 0x40;
+    d->period = dmc_periods[b & 0x0f];
+    if (!d->irq_enabled) {
+      a->dmc_irq = 0;
+      n->c->irq &= ~IRQ_DMC;
+    }
+    break;
+  case 0x4011:
+    d->level = b & 0x7f;
+    break;
+  case 0x4012:
+    d->start = 0xc000 + b * 64;
+    break;
+  case 0x4013:
+    d->length = b * 16 + 1;
+    break;
+
+  case 0x4015:
+    for (i = 0; i < 4; i++) {
+      ch = i < 2 ? &a->pulse[i] : i == 2 ? &a->triangle : &a->noise;
+      ch->enabled = b & (1 << i);
+      if (!ch->enabled)
+        ch->length = 0;
+    }
+    if (!(b & 0x10)) {
+      d->remaining = 0;
+    } else if (!d->remaining) {
+      d->address = d->start;
+      d->remaining = d->length;
+      dmc_fetch(n);
+    }
+    a->dmc_irq = 0;
+    n->c->irq &= ~IRQ_DMC;
+    break;
+
+  case 0x4017:
+    a->five_step = b & 0x80;
+    a->irq_inhibit = b & 0x40;
+    if (a->irq_inhibit) {
+      a->frame_irq = 0;
+      n->c->irq &= ~IRQ_FRAME;
+    }
+    a->frame_step = 0;
+    a->frame_timer = frame_times[0][0];
+    if (a->five_step) {
+      quarter_frame(a);
+      half_frame(a);
+      wake_all(a);
+    }
+    break;
+  }
+  mix(a);
+  set_deadline(a);
+}
+
+/*** setup ***/
+
+void apu_init (nes *n) {
+  apu *a;
+
+  pthread_once(&tables_made, &make_tables);
+  n->a = malloc(sizeof(apu));
+  a = n->a;
+  memset(a, 0, sizeof(apu));
+  a->pulse[0].period = a->pulse[0].timer = IDLE;
+  a->pulse[1].period = a->pulse[1].timer = IDLE;
+  a->triangle.period = a->triangle.timer = IDLE;
+  a->noise.period = a->noise.timer = noise_periods[0];
+  a->noise.lfsr = 1;
+  a->dmc.period = a->dmc.timer = dmc_periods[0];
+  a->dmc.bits = 8;
+  a->dmc.silence = 1;
+  a->frame_timer = frame_times[0][0];
+  a->level = tnd_mix[3 * triangle_table[0]];
+  atomic_init(&a->head, 0);
+  atomic_init(&a->tail, 0);
+  set_deadline(a);
+}
+
+/* start making sound at rate samples a second, keeping about latency of
+ * them queued up. Call before anything reads the ring */
+void apu_output (nes *n, int rate, unsigned latency) {
+  apu *a = n->a;
+
+  a->rate = rate;
+  a->ratio = rate / CPU_HZ;
+  a->buf = calloc(BUF_SIZE + BLIP_TAPS, sizeof(float));
+  a->buf_clock = a->clock;
+  a->buf_offset = 0;
+  a->sum = a->level;
+  a->hp_in = a->level;
+  a->hp_out = 0;
+  for (a->ring_size = 4096; a->ring_size < latency * 4; a->ring_size *= 2);
+  a->ring = calloc(a->ring_size, sizeof(int16_t));
+  a->target = latency;
+  a->last = 0;
+}
+
+/* samples waiting in the ring */
+unsigned apu_queued (apu *a) {
+  return atomic_load_explicit(&a->head, memory_order_acquire) -
+    atomic_load_explicit(&a->tail, memory_order_acquire);
+}
+
+/* the other end of the ring, for the sound card. If it runs dry the last
+ * sample is held rather than clicking */
+void apu_samples (apu *a, int16_t *out, int count) {
+  unsigned tail = atomic_load_explicit(&a->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&a->head, memory_order_acquire);
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (tail != head)
+      a->last = a->ring[tail++ & (a->ring_size - 1)];
+    out[i] = a->last;
+  }
+  atomic_store_explicit(&a->tail, tail, memory_order_release);
+}
+
+void apu_destroy (nes *n) {
+  free(n->a->buf);
+  free(n->a->ring);
+}
@@ -0,0 +1,242 @@
+/*
+ * batch.c
+ * by Max Willsey
+ * runs a list of jobs (a rom, a movie to play and a number of frames) on
+ * every core at once, and reports the frame each one ended on
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nes.h"
+
+/* a job file has one job a line: the rom, then the movie or - for none,
+ * then the frames to run, which can be left off to run to the end of the
+ * movie. blank lines and lines starting with # are skipped */
+typedef struct {
+  char *rom, *movie;
+  long frames;
+  /* what happened */
+  bit ok;
+  long ran;
+  uint64_t hash;
+} job;
+
+/* each worker has a deque of jobs. It takes them from the bottom of its
+ * own, and once that's empty it steals from the top of the others'. jobs
+ * last long enough that a lock on each deque costs nothing */
+typedef struct {
+  pthread_mutex_t lock;
+  int *jobs;
+  int top, bottom;
+} deque;
+
+typedef struct {
+  job *jobs;
+  int count;
+  deque *deques;
+  int workers;
+} pool;
+
+typedef struct {
+  pool *pool;
+  int id;
+  pthread_t thread;
+} worker;
+
+static int take (deque *d, bit steal) {
+  int j = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom)
+    j = steal ? d->jobs[d->top++] : d->jobs[--d->bottom];
+  pthread_mutex_unlock(&d->lock);
+  return j;
+}
+
+/* the next job for worker id, or -1 when there are none left anywhere.
+ * nothing's ever added, so once every deque is empty we're done */
+static int next_job (pool *p, int id) {
+  int j = take(&p->deques[id], 0), k;
+  for (k = 1; j < 0 && k < p->workers; k++)
+    j = take(&p->deques[(id + k) % p->workers], 1);
+  return j;
+}
+
+/* every job gets a machine of its own from power on */
+static void run_job (job *j) {
+  cart cart;
+  movie movie;
+  nes n;
+
+  j->ok = 0;
+  j->ran = 0;
+  if (cart_load(&cart, j->rom))
+    return;
+  nes_init(&n);
+  if (nes_insert(&n, &cart)) {
+    nes_destroy(&n);
+    cart_unload(&cart);
+    return;
+  }
+  cpu_load(&n);
+  if (!j->movie || !movie_play(&movie, &n, j->movie)) {
+    while (!j->frames || j->ran < j->frames) {
+      if (j->movie && movie_frame(&movie, &n))
+        break;
+      nes_frame(&n);
+      j->ran++;
+    }
+    if (j->movie)
+      movie_close(&movie);
+    j->hash = nes_frame_hash(&n);
+    j->ok = 1;
+  }
+  nes_destroy(&n);
+  cart_unload(&cart);
+}
+
+static void *run_worker (void *arg) {
+  worker *w = arg;
+  int j;
+  while ((j = next_job(w->pool, w->id)) >= 0)
+    run_job(&w->pool->jobs[j]);
+  return NULL;
+}
+
+/* read the jobs in file, returns how many or -1 */
+static int read_jobs (char *file, job **jobs) {
+  FILE *in = strcmp(file, "-") ? fopen(file, "r") : stdin;
+  char line[4096], *rom, *mov, *frames, *end;
+  int count = 0, size = 64, number = 0;
+  long n = 0;
+
+  if (!in) {
+    fprintf(stderr, "Could not open job file '%s'.\n", file);
+    return -1;
+  }
+  *jobs = malloc(sizeof(job) * size);
+  while (fgets(line, sizeof(line), in)) {
+    number++;
+    rom = strtok(line, " \t\r\n");
+    if (!rom || rom[0] == '#')
+      continue;
+    mov = strtok(NULL, " \t\r\n");
+    frames = strtok(NULL, " \t\r\n");
+    if (mov && !strcmp(mov, "-"))
+      mov = NULL;
+    if (frames) {
+      n = strtol(frames, &end, 10);
+      if (end == frames || *end || n < 0) {
+        fprintf(stderr, "%s:%d: '%s' is not a number of frames.\n",
+                file, number, frames);
+        count = -1;
+        break;
+      }
+    }
+    /* without a movie to end it, a job has to stop after some frames */
+    if (!mov && (!frames || n <= 0)) {
+      fprintf(stderr, "%s:%d: a job needs a movie or a number of frames.\n",
+              file, number);
+      count = -1;
+      break;
+    }
+    if (count == size) {
+      size *= 2;
+      *jobs = realloc(*jobs, sizeof(job) * size);
+    }
+    (*jobs)[count].rom = strdup(rom);
+    (*jobs)[count].movie = mov ? strdup(mov) : NULL;
+    (*jobs)[count].frames = frames ? n : 0;
+    count++;
+  }
+  if (in != stdin)
+    fclose(in);
+  return count;
+}
+
+int main (int argc, char **argv) {
+  struct timespec start, end;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long frames = 0;
+  int count, failed = 0, opt, i;
+  double secs;
+  worker *workers;
+  deque *d;
+  job *j;
+  pool p;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j':
+      /* threads to run, one per core by default */
+      threads = atol(optarg);
+      break;
+    default:
+      printf("Usage: %s [-j threads] job file\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || threads < 1) {
+    printf("Usage: %s [-j threads] job file\n", argv[0]);
+    return 1;
+  }
+  if ((count = read_jobs(argv[optind], &p.jobs)) < 0)
+    return 1;
+  if (threads > count)
+    threads = count > 0 ? count : 1;
+
+  /* deal the jobs out round the workers */
+  p.count = count;
+  p.workers = threads;
+  p.deques = malloc(sizeof(deque) * threads);
+  for (i = 0; i < threads; i++) {
+    pthread_mutex_init(&p.deques[i].lock, NULL);
+    p.deques[i].jobs = malloc(sizeof(int) * (count / threads + 1));
+    p.deques[i].top = p.deques[i].bottom = 0;
+  }
+  /* in reverse, so each worker takes its own in order */
+  for (i = 0; i < count; i++) {
+    d = &p.deques[i % threads];
+    d->jobs[d->bottom++] = count - 1 - i;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  workers = malloc(sizeof(worker) * threads);
+  for (i = 0; i < threads; i++) {
+    workers[i].pool = &p;
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, &run_worker, &workers[i]);
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join(workers[i].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  /* results in the order of the file */
+  for (i = 0; i < count; i++) {
+    j = &p.jobs[i];
+    if (j->ok)
+      printf("%016llx %8ld %s %s\n", (unsigned long long) j->hash, j->ran,
+             j->rom, j->movie ? j->movie : "-");
+    else
+      printf("failed           %8s %s %s\n", "", j->rom, j->movie ? j->movie : "-");
+    failed += !j->ok;
+    frames += j->ran;
+  }
+  printf("%d jobs (%d failed), %ld frames in %.3f s on %ld threads: "
+         "%.1f frames/s\n", count, failed, frames, secs, threads, frames / secs);
+
+  for (i = 0; i < threads; i++) {
+    pthread_mutex_destroy(&p.deques[i].lock);
+    free(p.deques[i].jobs);
+  }
+  for (i = 0; i < count; i++) {
+    free(p.jobs[i].rom);
+    free(p.jobs[i].movie);
+  }
+  free(p.deques);
+  free(p.jobs);
+  free(workers);
+  return failed ? 1 : 0;
+}
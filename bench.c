@@ -0,0 +1,185 @@
+/*
+ * bench.c
+ * by Max Willsey
+ * runs roms headless for a fixed number of frames and reports the speed,
+ * as JSON so runs can be compared across commits
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "nes.h"
+#include "palette.h"
+
+#define SOUND_RATE 48000
+
+static const char *part_names[PROF_PARTS] = {
+  "other", "cpu", "ppu", "apu", "io", "present"
+};
+
+typedef struct {
+  double secs;
+  uint64_t frames, instructions, cycles, dots;
+  profile prof;
+} result;
+
+static double seconds_since (struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* a JSON string, with quotes, backslashes and control characters escaped */
+static void print_string (const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      printf("\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      printf("\\u%04x", (unsigned char) *s);
+    else
+      putchar(*s);
+  }
+  putchar('"');
+}
+
+/* one run of a rom from power on, doing what the emulator does each frame:
+ * the frame, its sound and its pixels */
+static int run (char *file, long frames, bit profiled, result *res) {
+  static uint32_t pixels[240 * 256];
+  static int16_t samples[8192];
+  struct timespec start;
+  uint32_t colors[64];
+  palette pal;
+  uint64_t frame;
+  cart cart;
+  nes n;
+  long i;
+
+  if (cart_load(&cart, file))
+    return -1;
+  nes_init(&n);
+  if (nes_insert(&n, &cart)) {
+    nes_destroy(&n);
+    cart_unload(&cart);
+    return -1;
+  }
+  cpu_load(&n);
+  apu_output(&n, SOUND_RATE, SOUND_RATE / 20);
+  /* the colors don't matter, only the work */
+  for (i = 0; i < 64; i++)
+    colors[i] = 0xff000000u | i * 0x040404;
+  palette_init(&pal, colors);
+
+  n.prof.on = profiled;
+  n.prof.last = prof_clock();
+  res->instructions = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < frames; i++) {
+    /* nes_frame, counting instructions */
+    PROF_ENTER(&n, PROF_CPU);
+    frame = n.p->frames;
+    while (n.p->frames == frame) {
+      nes_step(&n);
+      res->instructions++;
+    }
+    PROF_LEAVE(&n);
+    apu_end_frame(&n);
+    /* the sound card's side, a frame is about 800 samples */
+    apu_samples(n.a, samples, apu_queued(n.a) < 8192 ? apu_queued(n.a) : 8192);
+
+    PROF_ENTER(&n, PROF_PRESENT);
+    palette_convert(&pal, pixels, 256 * 4, nes_frame_buffer(&n));
+    PROF_LEAVE(&n);
+  }
+  res->secs = seconds_since(&start);
+  n.prof.ticks[PROF_OTHER] += prof_clock() - n.prof.last;
+  n.prof.on = 0;
+
+  res->frames = frames;
+  res->cycles = n.c->cycles;
+  res->dots = n.p->clock;
+  res->prof = n.prof;
+  nes_destroy(&n);
+  cart_unload(&cart);
+  return 0;
+}
+
+/* a timed run for the speed, then a profiled one for where the time goes,
+ * since timing everything slows it down */
+static int bench (char *file, long frames, bit first) {
+  uint64_t ticks = 0;
+  double per_tick;
+  result r, pr;
+  int i;
+
+  if (run(file, frames, 0, &r) || run(file, frames, 1, &pr))
+    return -1;
+  for (i = 0; i < PROF_PARTS; i++)
+    ticks += pr.prof.ticks[i];
+  /* ticks might be cycles rather than nanoseconds, so scale them to the
+   * profiled run's time */
+  per_tick = ticks ? pr.secs / ticks : 0;
+
+  printf("%s\n    {\n", first ? "" : ",");
+  printf("      \"rom\": ");
+  print_string(file);
+  printf(",\n");
+  printf("      \"frames\": %llu,\n", (unsigned long long) r.frames);
+  printf("      \"seconds\": %.6f,\n", r.secs);
+  printf("      \"frames_per_sec\": %.2f,\n", r.frames / r.secs);
+  printf("      \"instructions_per_sec\": %.0f,\n", r.instructions / r.secs);
+  printf("      \"cpu_cycles_per_sec\": %.0f,\n", r.cycles / r.secs);
+  printf("      \"ppu_dots_per_sec\": %.0f,\n", r.dots / r.secs);
+  printf("      \"profiled_seconds\": %.6f,\n", pr.secs);
+  printf("      \"profile\": {");
+  for (i = 0; i < PROF_PARTS; i++)
+    printf("%s\n        \"%s\": {\"seconds\": %.6f, \"share\": %.4f, \"calls\": %llu}",
+           i ? "," : "", part_names[i], pr.prof.ticks[i] * per_tick,
+           ticks ? (double) pr.prof.ticks[i] / ticks : 0,
+           (unsigned long long) pr.prof.calls[i]);
+  printf("\n      }\n    }");
+  return 0;
+}
+
+int main (int argc, char **argv) {
+  long frames = 600;
+  char *label = NULL;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "f:l:")) != -1) {
+    switch (opt) {
+    case 'f':
+      frames = atol(optarg);
+      break;
+    case 'l':
+      /* a name for this run, like the commit */
+      label = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-f frames] [-l label] rom...\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind == argc || frames <= 0) {
+    fprintf(stderr, "Usage: %s [-f frames] [-l label] rom...\n", argv[0]);
+    return 1;
+  }
+
+#ifndef NES_PROFILE
+  fprintf(stderr, "Profiling was not compiled in, rebuild with -DNES_PROFILE.\n");
+#endif
+  printf("{\n");
+  if (label) {
+    printf("  \"label\": ");
+    print_string(label);
+    printf(",\n");
+  }
+  printf("  \"frames\": %ld,\n", frames);
+  printf("  \"roms\": [");
+  for (i = optind; i < argc; i++)
+    if (bench(argv[i], frames, i == optind))
+      return 1;
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * cart.c
+ * by Max Willsey
+ * loads iNES and NES 2.0 ROM files
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nes.h"
+
+/* NES 2.0 sizes can be given as 2^E * (M*2 + 1) when the high nibble is $f */
+static size_t rom_size (byte lsb, byte msb, size_t unit) {
+  if (msb == 0xf)
+    return ((size_t)1 << (lsb >> 2)) * ((lsb & 3) * 2 + 1);
+  return (((size_t)msb << 8) | lsb) * unit;
+}
+
+/* NES 2.0 ram sizes are 64 << n bytes, or none at all for 0 */
+static size_t ram_size (byte n) {
+  return n ? (size_t)64 << n : 0;
+}
+
+/* pull apart the 16 byte header */
+static void parse_header (cart *cart, byte *h) {
+  cart->nes2 = (h[7] & 0x0c) == 0x08;
+  cart->battery = (h[6] >> 1) & 1;
+  if (h[6] & 0x08)
+    cart->mirroring = MIRROR_FOUR_SCREEN;
+  else
+    cart->mirroring = (h[6] & 1) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+
+  if (cart->nes2) {
+    cart->mapper = (h[6] >> 4) | (h[7] & 0xf0) | ((h[8] & 0x0f) << 8);
+    cart->submapper = h[8] >> 4;
+    cart->prg_size = rom_size(h[4], h[9] & 0x0f, 0x4000);
+    cart->chr_size = rom_size(h[5], h[9] >> 4, 0x2000);
+    cart->prg_ram_size = ram_size(h[10] & 0x0f) + ram_size(h[10] >> 4);
+    cart->chr_ram_size = ram_size(h[11] & 0x0f) + ram_size(h[11] >> 4);
+  } else {
+    /* old dumps can have junk like "DiskDude!" in bytes 7-15, in which
+     * case the upper mapper nibble can't be trusted */
+    if (h[12] || h[13] || h[14] || h[15])
+      cart->mapper = h[6] >> 4;
+    else
+      cart->mapper = (h[6] >> 4) | (h[7] & 0xf0);
+    cart->submapper = 0;
+    cart->prg_size = h[4] * 0x4000;
+    cart->chr_size = h[5] * 0x2000;
+    /* 0 means 8K for compatibility */
+    cart->prg_ram_size = (h[8] ? h[8] : 1) * 0x2000;
+    cart->chr_ram_size = cart->chr_size ? 0 : 0x2000;
+  }
+}
+
+/* maps the whole file read only, so the banks are used right out of it.
+ * returns 0 on success, otherwise says why on stderr and returns -1 */
+int cart_load (cart *cart, char *file) {
+  struct stat st;
+  size_t need;
+  byte *h;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Given file '%s' could not be found.\n", file);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < 16) {
+    fprintf(stderr, "'%s' is too small to be a ROM.\n", file);
+    close(fd);
+    return -1;
+  }
+  cart->size = st.st_size;
+  cart->data = mmap(NULL, cart->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cart->data == MAP_FAILED) {
+    fprintf(stderr, "Could not map '%s'.\n", file);
+    return -1;
+  }
+
+  h = cart->data;
+  if (memcmp(h, "NES\x1a", 4)) {
+    fprintf(stderr, "'%s' doesn't have an iNES header.\n", file);
+    cart_unload(cart);
+    return -1;
+  }
+  parse_header(cart, h);
+
+  /* header, then the optional trainer, then PRG, then CHR */
+  need = 16;
+  cart->trainer = NULL;
+  if (h[6] & 0x04) {
+    cart->trainer = cart->data + need;
+    need += 512;
+  }
+  cart->prg = cart->data + need;
+  need += cart->prg_size;
+  cart->chr = cart->chr_size ? cart->data + need : NULL;
+  need += cart->chr_size;
+
+  if (!cart->prg_size || need > cart->size) {
+    fprintf(stderr, "'%s' is %zu bytes, but its header says %zu.\n",
+            file, cart->size, need);
+    cart_unload(cart);
+    return -1;
+  }
+  return 0;
+}
+
+void cart_unload (cart *cart) {
+  munmap(cart->data, cart->size);
+}
@@ -12,20 +12,20 @@
 
 /* use these wrappers because the stack is from 0x01ff to 0x100 */
 
-void push_byte (cpu *c, byte b) {
+static void push_byte (cpu *c, byte b) {
   mem_write(c->mem, 0x100 + c->SP--, b);
 }
 
-byte pull_byte (cpu *c) {
+static byte pull_byte (cpu *c) {
   return mem_read(c->mem, 0x100 + ++(c->SP));
 }
 
-void push_word (cpu *c, addr a) {
+static void push_word (cpu *c, addr a) {
   push_byte(c, (byte)(a >> 8));
   push_byte(c, (byte)(a));
 }
 
-addr pull_word (cpu *c) {
+static addr pull_word (cpu *c) {
   byte lo, hi;
   lo = pull_byte(c);
   hi = pull_byte(c);
@@ -51,12 +51,12 @@ enum flag {
 };
   
 /* get the desired flag  */
-int get_flag (cpu *c, enum flag n) { 
+static int get_flag (cpu *c, enum flag n) { 
   return (c->P >> n) & 0x1; 
 }
 
 /* set the desired flag accoriding to some bool */
-void set_flag (cpu *c, enum flag n, int b) {
+static void set_flag (cpu *c, enum flag n, int b) {
   if (b)
     c->P |= 0x1 << n;
   else
@@ -64,7 +64,7 @@ void set_flag (cpu *c, enum flag n, int b) {
 }
 
 /* shortcut to set zero and negative flag based on a byte */
-void set_zn_flags (cpu *c, byte b) {
+static void set_zn_flags (cpu *c, byte b) {
   set_flag(c, Z, !b);
   set_flag(c, N, b & 0x80);
 }
@@ -78,7 +78,8 @@ void set_zn_flags (cpu *c, byte b) {
 /* addressing will be handled by handing every instruction the address
  * of the byte it will be operating on. That way intructions can be
  * coded without knowledge of their addressing mode. Addressing will also
- * handle incrementing the PC according to the number of arguments */
+ * handle incrementing the PC according to the number of arguments. The
+ * bytes after the opcode are fetched along with it, into c->arg */
 
 /* accumulator
  * a few operations can work on the accumulator or memory, those have bee
@@ -90,7 +91,7 @@ void set_zn_flags (cpu *c, byte b) {
  * we will work with the invariant that the PC is incremented until 
  * the instruction is complete
  */
-addr am_imm (cpu *c) { 
+static addr am_imm (cpu *c) { 
   return c->PC++; 
 }
 
@@ -98,31 +99,34 @@ addr am_imm (cpu *c) {
  * only an 8-bit address operand is given, so only the first 0x100 (256) 
  * bytes of memory can be addressed (0x0000 - 0x00FF)
  */
-addr am_zer (cpu *c) { 
-  return mem_read(c->mem, c->PC++);
+static addr am_zer (cpu *c) { 
+  c->PC++;
+  return (byte)c->arg;
 }
 
 /* zero page,x
  * address to be accessed is the 8-bit value given in the instruction 
  * summed with the X register
  */
-addr am_zex (cpu *c) {
-  return (byte)(mem_read(c->mem, c->PC++) + c->X);
+static addr am_zex (cpu *c) {
+  c->PC++;
+  return (byte)(c->arg + c->X);
 }
 
 /* zero page,y
  * address to be accessed is the 8-bit value given in the instruction 
  * summed with the X register
  */
-addr am_zey (cpu *c) {
-  return (byte)(mem_read(c->mem, c->PC++) + c->Y);
+static addr am_zey (cpu *c) {
+  c->PC++;
+  return (byte)(c->arg + c->Y);
 }
 
 /* relative
  * addressing is identical to immediate, just handled in a signed manner
  * by the branch instructions
  */
-addr am_rel (cpu *c) { 
+static addr am_rel (cpu *c) { 
   return c->PC++; 
 }
 
@@ -130,33 +134,29 @@ addr am_rel (cpu *c) {
  * full address to be operated on is given 2 bytes following instruction 
  * don't forget the 6502 is least significant byte first
  */
-addr am_abs (cpu *c) {
-  byte lo, hi;
-  lo = mem_read(c->mem, c->PC++);
-  hi = mem_read(c->mem, c->PC++);
-  return ((addr)(hi) << 8) | lo;
+static addr am_abs (cpu *c) {
+  c->PC += 2;
+  return c->arg;
 }
 
 /* absolute,x
  * uses the full address given in the 2 bytes following instruction, but
- * also adds the X register
+ * also adds the X register. Reads that cross a page take an extra cycle
  */
-addr am_abx (cpu *c) {
-  byte lo, hi;
-  lo = mem_read(c->mem, c->PC++);
-  hi = mem_read(c->mem, c->PC++);
-  return (((addr)(hi) << 8) | lo) + c->X;
+static addr am_abx (cpu *c) {
+  c->PC += 2;
+  c->crossed = (c->arg & 0xff) + c->X > 0xff;
+  return c->arg + c->X;
 }
 
 /* absolute,y
  * uses the full address given in the 2 bytes following instruction, but
- * also adds the Y register
+ * also adds the Y register. Reads that cross a page take an extra cycle
  */
-addr am_aby (cpu *c) {
-  byte lo, hi;
-  lo = mem_read(c->mem, c->PC++);
-  hi = mem_read(c->mem, c->PC++);
-  return (((addr)(hi) << 8) | lo) + c->Y;
+static addr am_aby (cpu *c) {
+  c->PC += 2;
+  c->crossed = (c->arg & 0xff) + c->Y > 0xff;
+  return c->arg + c->Y;
 }
 
 /* indirect
@@ -165,15 +165,14 @@ addr am_aby (cpu *c) {
  * address you want. For our purposes, this is identical to absolute 
  * addressing
  */
-addr am_ind (cpu *c) {
-  byte lo, hi, lo2, hi2;
+static addr am_ind (cpu *c) {
+  byte lo2, hi2;
   addr a, a1;
-  lo = mem_read(c->mem, c->PC++);
-  hi = mem_read(c->mem, c->PC++);
-  a = ((addr)(hi) << 8) | lo;
+  c->PC += 2;
+  a = c->arg;
   /* a1 is a + 1 in most cases, except to represnt a bug in the hardware 
    * where it really only adds 1 to the lo byte*/
-  a1 = ((addr)(hi) << 8) | (byte)(lo + 1);
+  a1 = (a & 0xff00) | (byte)(a + 1);
   /* now start getting the target address */
   lo2 = mem_read(c->mem, a);
   hi2 = mem_read(c->mem, a1);
@@ -185,9 +184,10 @@ addr am_ind (cpu *c) {
  * following the instruction gives the base address, and the index is in 
  * the X register. That will contain the LSB of the target address
  */
-addr am_inx (cpu *c) {
+static addr am_inx (cpu *c) {
   byte base, lo, hi;
-  base = mem_read(c->mem, c->PC++);
+  c->PC++;
+  base = c->arg;
   lo = base + c->X;
   hi = base + c->X + 1;
   return ((addr)mem_read(c->mem, hi) << 8) | mem_read(c->mem, lo);
@@ -195,14 +195,16 @@ addr am_inx (cpu *c) {
 
 /* indirect indexed
  * byte following instruction is the zero page address of the LSB of a 16-bit
- * address. Then add the Y-register to that
+ * address. Then add the Y-register to that, which can cross a page
  */
-addr am_iny (cpu *c) {
+static addr am_iny (cpu *c) {
   byte z, lo, hi;
-  z = mem_read(c->mem, c->PC++);
-  lo = z;
-  hi = z + 1;
-  return (((addr)(mem_read(c->mem, hi)) << 8) | mem_read(c->mem, lo)) + c->Y;
+  c->PC++;
+  z = c->arg;
+  lo = mem_read(c->mem, z);
+  hi = mem_read(c->mem, (byte)(z + 1));
+  c->crossed = lo + c->Y > 0xff;
+  return (((addr)hi << 8) | lo) + c->Y;
 }
 
 
@@ -221,35 +223,35 @@ addr am_iny (cpu *c) {
  */
 
 /* load accumulator */
-void LDA (cpu *c, addr a) {
+static void LDA (cpu *c, addr a) {
   c->A = mem_read(c->mem, a);
   set_zn_flags(c, c->A);
 }
 
 /* load X register */
-void LDX (cpu *c, addr a) {
+static void LDX (cpu *c, addr a) {
   c->X = mem_read(c->mem, a);
   set_zn_flags(c, c->X);
 }
 
 /* load Y register */
-void LDY (cpu *c, addr a) {
+static void LDY (cpu *c, addr a) {
   c->Y = mem_read(c->mem, a);
   set_zn_flags(c, c->Y);
 }
 
 /* store accumulator */
-void STA (cpu *c, addr a) {
+static void STA (cpu *c, addr a) {
   mem_write(c->mem, a, c->A);
 }
 
 /* store X register */
-void STX (cpu *c, addr a) {
+static void STX (cpu *c, addr a) {
   mem_write(c->mem, a, c->X);
 }
 
 /* store Y register */
-void STY (cpu *c, addr a) {
+static void STY (cpu *c, addr a) {
   mem_write(c->mem, a, c->Y);
 }
 
@@ -260,25 +262,25 @@ void STY (cpu *c, addr a) {
 /* these use implied addressing, so no second parameter needed */
 
 /* transfer accumulator to X */
-void TAX (cpu *c) {
+static void TAX (cpu *c) {
   c->X = c->A;
   set_zn_flags(c, c->X);
 }
 
 /* transfer accumulator to Y */
-void TAY (cpu *c) {
+static void TAY (cpu *c) {
   c->Y = c->A;
   set_zn_flags(c, c->Y);
 }
 
 /* transfer X to accumulator */
-void TXA (cpu *c) {
+static void TXA (cpu *c) {
   c->A = c->X;
   set_zn_flags(c, c->A);
 }
 
 /* transfer Y to accumulator */
-void TYA (cpu *c) {
+static void TYA (cpu *c) {
   c->A = c->Y;
   set_zn_flags(c, c->A);
 }
@@ -292,36 +294,36 @@ void TYA (cpu *c) {
  * and that it grows downward */
 
 /* transfer stack pointer to X */
-void TSX (cpu *c) {
+static void TSX (cpu *c) {
   c->X = c->SP;
   set_zn_flags(c, c->X);
 }
 
 /* transfer X to stack pointer */
-void TXS (cpu *c) {
+static void TXS (cpu *c) {
   c->SP = c->X;
 }
 
 /* push accumulator onto the stack */
-void PHA (cpu *c) {
+static void PHA (cpu *c) {
   push_byte(c, c->A);
 }
 
 /* push processor status onto stack */
-void PHP (cpu *c) {
+static void PHP (cpu *c) {
   /* bit 4 is always set when pushed to stack */
   push_byte(c, c->P | 0x10);
 }
 
 /* pull accumulator from stack */
-void PLA (cpu *c) {
+static void PLA (cpu *c) {
   c->A = pull_byte(c);
   /* set zero and negative flags */
   set_zn_flags(c, c->A);
 }
 
 /* pull processor status from stack */
-void PLP (cpu *c) {
+static void PLP (cpu *c) {
   /* bit 4 is never set when pulled from stack */
   /* bit 5 is always set */
   c->P = (pull_byte(c) & ~(0x10)) | 0x20;
@@ -332,25 +334,25 @@ void PLP (cpu *c) {
  */
 
 /* logical and */
-void AND (cpu *c, addr a) {         
+static void AND (cpu *c, addr a) {         
   c->A &= mem_read(c->mem, a);
   set_zn_flags(c, c->A);
 }
 
 /* exclusive or */
-void EOR (cpu *c, addr a) {         
+static void EOR (cpu *c, addr a) {         
   c->A ^= mem_read(c->mem, a);
   set_zn_flags(c, c->A);
 }
 
 /* inclusive or */
-void ORA (cpu *c, addr a) {         
+static void ORA (cpu *c, addr a) {         
   c->A |= mem_read(c->mem, a);
   set_zn_flags(c, c->A);
 }
 
 /* bit test */
-void BIT (cpu *c, addr a) {
+static void BIT (cpu *c, addr a) {
   byte b = mem_read(c->mem, a);
   /* set zero flag according and but don't keep result */
   set_flag(c, Z, !(b & c->A));
@@ -363,10 +365,9 @@ void BIT (cpu *c, addr a) {
  * ----- arithmetic operations -----
  */
 
-/* add with carry */
-void ADC (cpu *c, addr a) {
+/* add a byte and the carry into the accumulator, for ADC and SBC */
+static void add (cpu *c, byte b) {
   byte sum, j, k, c6, c7;
-  byte b = mem_read(c->mem, a);
   /* NES actually ignores decimal mode, but you could enter this if in 
    * decimal mode and it should work. */
   if (0) {
@@ -405,16 +406,19 @@ void ADC (cpu *c, addr a) {
   }
 }
 
+/* add with carry */
+static void ADC (cpu *c, addr a) {
+  add(c, mem_read(c->mem, a));
+}
+
 /* subtract with carry (borrow) */
-void SBC (cpu *c, addr a) {
+static void SBC (cpu *c, addr a) {
   /* just use the addition logic on the negated byte */
-  mem_write(c->mem, a, ~mem_read(c->mem, a));
-  ADC(c, a);
-  mem_write(c->mem, a, ~mem_read(c->mem, a));
+  add(c, ~mem_read(c->mem, a));
 }
 
 /* compare accumulator */
-void CMP (cpu *c, addr a) {
+static void CMP (cpu *c, addr a) {
   byte b, r;
   b = mem_read(c->mem, a);
   r = c->A - b;
@@ -424,7 +428,7 @@ void CMP (cpu *c, addr a) {
 }
 
 /* compare X register */
-void CPX (cpu *c, addr a) {
+static void CPX (cpu *c, addr a) {
   byte b, r;
   b = mem_read(c->mem, a);
   r = c->X - b;
@@ -434,7 +438,7 @@ void CPX (cpu *c, addr a) {
 }
 
 /* compare Y register */
-void CPY (cpu *c, addr a) {
+static void CPY (cpu *c, addr a) {
   byte b, r;
   b = mem_read(c->mem, a);
   r = c->Y - b;
@@ -450,39 +454,39 @@ void CPY (cpu *c, addr a) {
 /* inc/dec on registers use implied addressing, so no second parameter */
 
 /* increment a memory location */
-void INC (cpu *c, addr a) {
+static void INC (cpu *c, addr a) {
   byte b = mem_read(c->mem, a) + 1;
   mem_write(c->mem, a, b);
   set_zn_flags(c, b);
 }
 
 /* increment X register */
-void INX (cpu *c) {
+static void INX (cpu *c) {
   c->X++;
   set_zn_flags(c, c->X);
 }
 
 /* increment Y register */
-void INY (cpu *c) {
+static void INY (cpu *c) {
   c->Y++;
   set_zn_flags(c, c->Y);
 }
 
 /* decrement a memory location */
-void DEC (cpu *c, addr a) {
+static void DEC (cpu *c, addr a) {
   byte b = mem_read(c->mem, a) - 1;
   mem_write(c->mem, a, b);
   set_zn_flags(c, b);
 }
 
 /* decrement X register */
-void DEX (cpu *c) {
+static void DEX (cpu *c) {
   c->X--;
   set_zn_flags(c, c->X);
 }
 
 /* decrement Y register */
-void DEY (cpu *c) {
+static void DEY (cpu *c) {
   c->Y--;
   set_zn_flags(c, c->Y);
 }
@@ -495,13 +499,13 @@ void DEY (cpu *c) {
  * and they will be split off into separate functions */
 
 /* arithmetic shift left */
-void ASLa (cpu *c) {
+static void ASLa (cpu *c) {
   set_flag(c, C, c->A & 0x80);
   c->A <<= 1;
   set_zn_flags(c, c->A);
 }
 
-void ASL (cpu *c, addr a) {
+static void ASL (cpu *c, addr a) {
   byte b = mem_read(c->mem, a);
   set_flag(c, C, b & 0x80); 
   b <<= 1;
@@ -510,13 +514,13 @@ void ASL (cpu *c, addr a) {
 }
 
 /* logical shift right */
-void LSRa (cpu *c) {
+static void LSRa (cpu *c) {
   set_flag(c, C, c->A & 0x1);
   c->A >>= 1;
   set_zn_flags(c, c->A);
 } 
 
-void LSR (cpu *c, addr a) {
+static void LSR (cpu *c, addr a) {
   byte b = mem_read(c->mem, a);
   set_flag(c, C, b & 0x1); 
   b >>= 1;
@@ -525,7 +529,7 @@ void LSR (cpu *c, addr a) {
 }
 
 /* rotate left */
-void ROLa (cpu *c) {
+static void ROLa (cpu *c) {
   byte bit;
   bit = (c->A >> 7 & 0x1);
   c->A = (c->A << 1) | get_flag(c, C);
@@ -533,7 +537,7 @@ void ROLa (cpu *c) {
   set_zn_flags(c, c->A);
 } 
 
-void ROL (cpu *c, addr a) {
+static void ROL (cpu *c, addr a) {
   byte bit, b;
   b = mem_read(c->mem, a);
   bit = (b >> 7) & 0x1;
@@ -545,7 +549,7 @@ void ROL (cpu *c, addr a) {
 
 
 /* rotate right */
-void RORa (cpu *c) {
+static void RORa (cpu *c) {
   byte bit;
   bit = c->A & 0x1;
   c->A = (c->A >> 1) | (get_flag(c, C) << 7);
@@ -553,7 +557,7 @@ void RORa (cpu *c) {
   set_zn_flags(c, c->A);
 } 
 
-void ROR (cpu *c, addr a) { 
+static void ROR (cpu *c, addr a) { 
   byte bit, b;
   b = mem_read(c->mem, a);
   bit = b & 0x1;
@@ -570,18 +574,18 @@ void ROR (cpu *c, addr a) {
 /* return uses implied addressing, so no second parameter */
 
 /* jump to another location */
-void JMP (cpu *c, addr a) {
+static void JMP (cpu *c, addr a) {
   c->PC = a;
 }
 
 /* jump to subroutine */
-void JSR (cpu *c, addr a) {
+static void JSR (cpu *c, addr a) {
   push_word(c, c->PC - 1);
   c->PC = a; //IDK if this will pass nestest
 }
 
 /* return from subroutine */
-void RTS (cpu *c) {
+static void RTS (cpu *c) {
   c->PC = pull_word(c) + 1;
 }
 
@@ -589,52 +593,55 @@ void RTS (cpu *c) {
  * ----- branches -----
  */
 
+/* a taken branch costs 1 extra cycle, and 1 more if it lands on a
+ * different page than the following instruction */
+static void branch (cpu *c, addr a, int cond) {
+  addr target;
+  if (!cond)
+    return;
+  target = c->PC + (int8_t)mem_read(c->mem, a);
+  c->extra += 1 + ((target & 0xff00) != (c->PC & 0xff00));
+  c->PC = target;
+}
+
 /* branch if carry set */
-void BCS (cpu *c, addr a) {
-  if (get_flag(c, C))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BCS (cpu *c, addr a) {
+  branch(c, a, get_flag(c, C));
 }
 
 /* branch if carry clear */
-void BCC (cpu *c, addr a) {
-  if (!get_flag(c, C))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BCC (cpu *c, addr a) {
+  branch(c, a, !get_flag(c, C));
 }
 
 /* branch if equal (zero set) */
-void BEQ (cpu *c, addr a) {
-  if (get_flag(c, Z))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BEQ (cpu *c, addr a) {
+  branch(c, a, get_flag(c, Z));
 }
 
 /* branch if not equal (zero clear) */
-void BNE (cpu *c, addr a) {
-  if (!get_flag(c, Z))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BNE (cpu *c, addr a) {
+  branch(c, a, !get_flag(c, Z));
 }
 
 /* branch if minus (negative set) */
-void BMI (cpu *c, addr a) {
-  if (get_flag(c, N))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BMI (cpu *c, addr a) {
+  branch(c, a, get_flag(c, N));
 }
 
 /* branch if positive (negative clear) */
-void BPL (cpu *c, addr a) {
-  if (!get_flag(c, N))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BPL (cpu *c, addr a) {
+  branch(c, a, !get_flag(c, N));
 }
 
 /* branch if overflow set */
-void BVS (cpu *c, addr a) {
-  if (get_flag(c, V))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BVS (cpu *c, addr a) {
+  branch(c, a, get_flag(c, V));
 }
 
 /* branch if overflow clear */
-void BVC (cpu *c, addr a) {
-  if (!get_flag(c, V))
-    c->PC += (int8_t)mem_read(c->mem, a);
+static void BVC (cpu *c, addr a) {
+  branch(c, a, !get_flag(c, V));
 }
 
 /* 
@@ -644,37 +651,37 @@ void BVC (cpu *c, addr a) {
 /* these all use implied addressing */
 
 /* clear carry flag */
-void CLC (cpu *c) {
+static void CLC (cpu *c) {
   set_flag(c, C, 0);
 }
 
 /* clear decimal flag */
-void CLD (cpu *c) {
+static void CLD (cpu *c) {
   set_flag(c, D, 0);
 }
 
 /* clear interrupt flag */
-void CLI (cpu *c) {
+static void CLI (cpu *c) {
   set_flag(c, I, 0);
 }
 
 /* clear overflow flag */
-void CLV (cpu *c) {
+static void CLV (cpu *c) {
   set_flag(c, V, 0);
 }
 
 /* set carry flag */
-void SEC (cpu *c) {
+static void SEC (cpu *c) {
   set_flag(c, C, 1);
 }
 
 /* set decimal flag */
-void SED (cpu *c) {
+static void SED (cpu *c) {
   set_flag(c, D, 1);
 }
 
 /* set interrupt flag */
-void SEI (cpu *c) {
+static void SEI (cpu *c) {
   set_flag(c, I, 1);
 }
 
@@ -685,7 +692,7 @@ void SEI (cpu *c) {
 /* these also use implied addressing */
 
 /* force interrupt */
-void BRK (cpu *c) {
+static void BRK (cpu *c) {
   byte lo, hi;
   /* push PC then P onto the stack */
   /* bits 4,5 is always set when pushed to the stack from BRK */
@@ -695,34 +702,418 @@ void BRK (cpu *c) {
   lo = mem_read(c->mem, 0xfffe);
   hi = mem_read(c->mem, 0xffff);
 
-  printf("breaking to: %04x\n", *((addr*)(c->mem->ram + 0xfffe))); //((addr)(hi) << 8) | lo);
-
   c->PC = ((addr)(hi) << 8) | lo;
 }
 
 /* no operation */
-void NOP (cpu *c) {
+static void NOP (cpu *c) {
   /* silence compiler */
   (void)c;
 }
 
 /* skip byte (illegal) */
-void SKB (cpu *c) {
+static void SKB (cpu *c) {
   c->PC++;
 }
 
 /* skip word (illegal) */
-void SKW (cpu *c) {
+static void SKW (cpu *c) {
   c->PC += 2;
 }
 
-void RTI (cpu *c) {
+/* ignore (illegal), reads an operand and throws it away */
+static void IGN (cpu *c, addr a) {
+  (void)c;
+  (void)a;
+}
+
+static void RTI (cpu *c) {
   /* pull P then PC from the stack */
   c->P = (pull_byte(c) & ~(0x10)) | 0x20;
   c->PC = pull_word(c);
 }
 
 
+/* 
+ * ---------- timing ----------
+ */
+
+/* base number of cycles taken by each opcode */
+static const byte cycle_table[256] = {
+/*      0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f */
+/* 0 */ 7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+/* 1 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 2 */ 6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+/* 3 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 4 */ 6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+/* 5 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 6 */ 6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+/* 7 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 8 */ 2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+/* 9 */ 2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+/* a */ 2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+/* b */ 2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+/* c */ 2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+/* d */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* e */ 2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+/* f */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7
+};
+
+/* opcodes that take an extra cycle when their indexed read crosses a page.
+ * stores and read-modify-writes always pay it, so it's in their base count */
+static const byte cross_table[256] = {
+/*      0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f */
+/* 0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 1 */ 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+/* 2 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 3 */ 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+/* 4 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 5 */ 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+/* 6 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 7 */ 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+/* 8 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 9 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* a */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* b */ 0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, 1, 1, 1, 1,
+/* c */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* d */ 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+/* e */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* f */ 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0
+};
+
+
+/* 
+ * ---------- dispatch ----------
+ */
+
+/* every opcode the cpu knows about as X(opcode, instruction, mode),
+ * alphabetical by instruction. implied and accumulator instructions 
+ * use the imp mode */
+#define OPCODES(X)                                                         \
+    /* ADC */                                                              \
+  X(0x69, ADC, imm) X(0x65, ADC, zer) X(0x75, ADC, zex) X(0x6d, ADC, abs)  \
+  X(0x7d, ADC, abx) X(0x79, ADC, aby) X(0x61, ADC, inx) X(0x71, ADC, iny)  \
+    /* AND */                                                              \
+  X(0x29, AND, imm) X(0x25, AND, zer) X(0x35, AND, zex) X(0x2d, AND, abs)  \
+  X(0x3d, AND, abx) X(0x39, AND, aby) X(0x21, AND, inx) X(0x31, AND, iny)  \
+    /* ASL */                                                              \
+  X(0x0a, ASLa, imp) X(0x06, ASL, zer) X(0x16, ASL, zex) X(0x0e, ASL, abs) \
+  X(0x1e, ASL, abx)                                                        \
+    /* BIT */                                                              \
+  X(0x24, BIT, zer) X(0x2c, BIT, abs)                                      \
+    /* branches */                                                         \
+  X(0x10, BPL, rel) X(0x30, BMI, rel) X(0x50, BVC, rel) X(0x70, BVS, rel)  \
+  X(0x90, BCC, rel) X(0xb0, BCS, rel) X(0xd0, BNE, rel) X(0xf0, BEQ, rel)  \
+    /* BRK */                                                              \
+  X(0x00, BRK, imp)                                                        \
+    /* CMP */                                                              \
+  X(0xc9, CMP, imm) X(0xc5, CMP, zer) X(0xd5, CMP, zex) X(0xcd, CMP, abs)  \
+  X(0xdd, CMP, abx) X(0xd9, CMP, aby) X(0xc1, CMP, inx) X(0xd1, CMP, iny)  \
+    /* CPX */                                                              \
+  X(0xe0, CPX, imm) X(0xe4, CPX, zer) X(0xec, CPX, abs)                    \
+    /* CPY */                                                              \
+  X(0xc0, CPY, imm) X(0xc4, CPY, zer) X(0xcc, CPY, abs)                    \
+    /* DEC */                                                              \
+  X(0xc6, DEC, zer) X(0xd6, DEC, zex) X(0xce, DEC, abs) X(0xde, DEC, abx)  \
+    /* EOR */                                                              \
+  X(0x49, EOR, imm) X(0x45, EOR, zer) X(0x55, EOR, zex) X(0x4d, EOR, abs)  \
+  X(0x5d, EOR, abx) X(0x59, EOR, aby) X(0x41, EOR, inx) X(0x51, EOR, iny)  \
+    /* status flag operations */                                           \
+  X(0x18, CLC, imp) X(0x38, SEC, imp) X(0x58, CLI, imp) X(0x78, SEI, imp)  \
+  X(0xb8, CLV, imp) X(0xd8, CLD, imp) X(0xf8, SED, imp)                    \
+    /* INC */                                                              \
+  X(0xe6, INC, zer) X(0xf6, INC, zex) X(0xee, INC, abs) X(0xfe, INC, abx)  \
+    /* JMP */                                                              \
+  X(0x4c, JMP, abs) X(0x6c, JMP, ind)                                      \
+    /* JSR */                                                              \
+  X(0x20, JSR, abs)                                                        \
+    /* LDA */                                                              \
+  X(0xa9, LDA, imm) X(0xa5, LDA, zer) X(0xb5, LDA, zex) X(0xad, LDA, abs)  \
+  X(0xbd, LDA, abx) X(0xb9, LDA, aby) X(0xa1, LDA, inx) X(0xb1, LDA, iny)  \
+    /* LDX */                                                              \
+  X(0xa2, LDX, imm) X(0xa6, LDX, zer) X(0xb6, LDX, zey) X(0xae, LDX, abs)  \
+  X(0xbe, LDX, aby)                                                        \
+    /* LDY */                                                              \
+  X(0xa0, LDY, imm) X(0xa4, LDY, zer) X(0xb4, LDY, zex) X(0xac, LDY, abs)  \
+  X(0xbc, LDY, abx)                                                        \
+    /* LSR */                                                              \
+  X(0x4a, LSRa, imp) X(0x46, LSR, zer) X(0x56, LSR, zex) X(0x4e, LSR, abs) \
+  X(0x5e, LSR, abx)                                                        \
+    /* NOP and it's extra illegal codes */                                 \
+  X(0x1a, NOP, imp) X(0x3a, NOP, imp) X(0x5a, NOP, imp) X(0x7a, NOP, imp)  \
+  X(0xda, NOP, imp) X(0xfa, NOP, imp) X(0xea, NOP, imp)                    \
+    /* ORA */                                                              \
+  X(0x09, ORA, imm) X(0x05, ORA, zer) X(0x15, ORA, zex) X(0x0d, ORA, abs)  \
+  X(0x1d, ORA, abx) X(0x19, ORA, aby) X(0x01, ORA, inx) X(0x11, ORA, iny)  \
+    /* register instructions */                                            \
+  X(0xaa, TAX, imp) X(0x8a, TXA, imp) X(0xca, DEX, imp) X(0xe8, INX, imp)  \
+  X(0xa8, TAY, imp) X(0x98, TYA, imp) X(0x88, DEY, imp) X(0xc8, INY, imp)  \
+    /* ROL */                                                              \
+  X(0x2a, ROLa, imp) X(0x26, ROL, zer) X(0x36, ROL, zex) X(0x2e, ROL, abs) \
+  X(0x3e, ROL, abx)                                                        \
+    /* ROR */                                                              \
+  X(0x6a, RORa, imp) X(0x66, ROR, zer) X(0x76, ROR, zex) X(0x6e, ROR, abs) \
+  X(0x7e, ROR, abx)                                                        \
+    /* RTI */                                                              \
+  X(0x40, RTI, imp)                                                        \
+    /* RTS */                                                              \
+  X(0x60, RTS, imp)                                                        \
+    /* SBC */                                                              \
+  X(0xe9, SBC, imm) X(0xe5, SBC, zer) X(0xf5, SBC, zex) X(0xed, SBC, abs)  \
+  X(0xfd, SBC, abx) X(0xf9, SBC, aby) X(0xe1, SBC, inx) X(0xf1, SBC, iny)  \
+    /* STA */                                                              \
+  X(0x85, STA, zer) X(0x95, STA, zex) X(0x8d, STA, abs) X(0x9d, STA, abx)  \
+  X(0x99, STA, aby) X(0x81, STA, inx) X(0x91, STA, iny)                    \
+    /* stack instructions */                                               \
+  X(0x9a, TXS, imp) X(0xba, TSX, imp) X(0x48, PHA, imp) X(0x68, PLA, imp)  \
+  X(0x08, PHP, imp) X(0x28, PLP, imp)                                      \
+    /* STX */                                                              \
+  X(0x86, STX, zer) X(0x96, STX, zey) X(0x8e, STX, abs)                    \
+    /* STY */                                                              \
+  X(0x84, STY, zer) X(0x94, STY, zex) X(0x8c, STY, abs)                    \
+    /* illegal opcodes go to SKB skip byte / SKW skip word / IGN ignore */ \
+  X(0x80, SKB, imp) X(0x82, SKB, imp) X(0xc2, SKB, imp) X(0xe2, SKB, imp)  \
+  X(0x04, SKB, imp) X(0x14, SKB, imp) X(0x34, SKB, imp) X(0x44, SKB, imp)  \
+  X(0x54, SKB, imp) X(0x64, SKB, imp) X(0x74, SKB, imp) X(0xd4, SKB, imp)  \
+  X(0xf4, SKB, imp) X(0x0c, SKW, imp) X(0x1c, IGN, abx) X(0x3c, IGN, abx)  \
+  X(0x5c, IGN, abx) X(0x7c, IGN, abx) X(0xdc, IGN, abx) X(0xfc, IGN, abx)
+
+/* how each addressing mode hands its operand to an instruction */
+#define EXEC_imp(ins) ins(c)
+#define EXEC_imm(ins) ins(c, am_imm(c))
+#define EXEC_zer(ins) ins(c, am_zer(c))
+#define EXEC_zex(ins) ins(c, am_zex(c))
+#define EXEC_zey(ins) ins(c, am_zey(c))
+#define EXEC_rel(ins) ins(c, am_rel(c))
+#define EXEC_abs(ins) ins(c, am_abs(c))
+#define EXEC_abx(ins) ins(c, am_abx(c))
+#define EXEC_aby(ins) ins(c, am_aby(c))
+#define EXEC_ind(ins) ins(c, am_ind(c))
+#define EXEC_inx(ins) ins(c, am_inx(c))
+#define EXEC_iny(ins) ins(c, am_iny(c))
+
+/* GCC can jump straight to the body of each opcode with computed gotos,
+ * other compilers go through a table of fused opcode functions */
+#if defined(__GNUC__) && !defined(CPU_NO_THREADING)
+#define CPU_THREADED
+#else
+
+/* one function per opcode, with the addressing mode fused into the
+ * instruction so both get inlined */
+#define FUSED(code, ins, mode) static void op_##code (cpu *c) { EXEC_##mode(ins); }
+OPCODES(FUSED)
+
+#define ENTRY(code, ins, mode) [code] = op_##code,
+static void (*const op_table[256]) (cpu *c) = {
+  OPCODES(ENTRY)
+};
+
+#endif
+
+
+/* 
+ * ---------- decode cache ----------
+ */
+
+/* an instruction is decoded the first time it runs, along with the
+ * straight line of instructions after it up to the next jump or branch.
+ * after that its opcode and operand come out of the cache instead of
+ * memory. Pages are found by their bytes, so each bank of a cartridge
+ * keeps its own decoding across bank switches. Ram with code in it is
+ * watched, and a write to it throws away the instructions it lands in */
+
+/* bytes each addressing mode takes, with the opcode */
+#define SIZE_imp 1
+#define SIZE_imm 2
+#define SIZE_zer 2
+#define SIZE_zex 2
+#define SIZE_zey 2
+#define SIZE_rel 2
+#define SIZE_abs 3
+#define SIZE_abx 3
+#define SIZE_aby 3
+#define SIZE_ind 3
+#define SIZE_inx 2
+#define SIZE_iny 2
+
+#define SIZE(code, ins, mode) [code] = SIZE_##mode,
+static const byte size_table[256] = {
+  OPCODES(SIZE)
+};
+
+/* the size of an instruction that runs into the next page, which might
+ * not be the same bank next time. It's read from memory every time */
+#define SPLIT 4
+
+/* after these the next instruction isn't the one that follows: jumps,
+ * calls, returns, BRK and the branches */
+static bit ends_block (byte op) {
+  switch (op) {
+  case 0x00: case 0x20: case 0x40: case 0x4c: case 0x60: case 0x6c:
+    return 1;
+  }
+  return (op & 0x1f) == 0x10;
+}
+
+static int hash_base (byte *base, int size) {
+  return ((uintptr_t)base >> MEM_PAGE_BITS) * 2654435761u & (size - 1);
+}
+
+static void insert_page (cpu *c, decoded_page *d) {
+  int i = hash_base(d->base, c->decoded_size);
+  while (c->decoded[i])
+    i = (i + 1) & (c->decoded_size - 1);
+  c->decoded[i] = d;
+}
+
+/* the decoding of the page at base, NULL if there isn't one */
+static decoded_page *find_page (cpu *c, byte *base) {
+  int i = hash_base(base, c->decoded_size);
+  for (; c->decoded[i]; i = (i + 1) & (c->decoded_size - 1))
+    if (c->decoded[i]->base == base)
+      return c->decoded[i];
+  return NULL;
+}
+
+/* the decoding of the page at base, made empty if there isn't one yet */
+static decoded_page *add_page (cpu *c, byte *base) {
+  decoded_page *d = find_page(c, base), **old = c->decoded;
+  int size = c->decoded_size, i;
+
+  if (d)
+    return d;
+  /* keep the table at most half full */
+  if (2 * (c->decoded_count + 1) > size) {
+    c->decoded_size *= 2;
+    c->decoded = calloc(c->decoded_size, sizeof(decoded_page *));
+    for (i = 0; i < size; i++)
+      if (old[i])
+        insert_page(c, old[i]);
+    free(old);
+  }
+  d = calloc(1, sizeof(decoded_page));
+  d->base = base;
+  insert_page(c, d);
+  c->decoded_count++;
+  return d;
+}
+
+/* a write to ram with code in it. Any instruction that it lands in has to
+ * be decoded again */
+static void code_write (nes *n, addr a, byte b) {
+  decoded_page *d = n->c->guarded[a >> MEM_PAGE_BITS];
+  int i = a & (MEM_PAGE_SIZE - 1), k;
+
+  for (k = i < 2 ? 0 : i - 2; k <= i; k++)
+    d->ops[k].size = 0;
+  d->base[i] = b;
+}
+
+/* send page p's writes, which go to d's bytes, through code_write. Its old
+ * callback is kept to put back when the page is mapped to something else */
+static void guard (cpu *c, int p, decoded_page *d) {
+  memory *mem = c->mem;
+  c->guarded[p] = d;
+  c->guarded_cbs[p] = mem->write_cbs[p];
+  mem->write_pages[p] = NULL;
+  mem->write_cbs[p] = &code_write;
+}
+
+/* the memory map changed. Let go of pages that were mapped over, and
+ * watch any ram with code in it that's just been mapped in */
+static void remap (cpu *c) {
+  memory *mem = c->mem;
+  decoded_page *d;
+  int p;
+
+  for (p = 0; p < MEM_PAGES; p++) {
+    if (c->guarded[p] && (mem->read_pages[p] != c->guarded[p]->base ||
+                          mem->write_pages[p] ||
+                          mem->write_cbs[p] != &code_write)) {
+      if (mem->write_cbs[p] == &code_write)
+        mem->write_cbs[p] = c->guarded_cbs[p];
+      c->guarded[p] = NULL;
+    }
+    if (mem->write_pages[p] && (d = find_page(c, mem->write_pages[p])))
+      guard(c, p, d);
+    if (c->code[p] && c->code[p]->base != mem->read_pages[p])
+      c->code[p] = NULL;
+  }
+  c->code_changes = mem->changes;
+}
+
+/* look up the decoding of page p, or NULL for i/o, which has to be read
+ * every time. If it's ram, every page that writes to it gets watched */
+static decoded_page *code_page (cpu *c, int p) {
+  memory *mem = c->mem;
+  byte *base = mem->read_pages[p];
+  decoded_page *d;
+  int q;
+
+  if (!base)
+    return NULL;
+  d = c->code[p] = add_page(c, base);
+  if (mem->write_pages[p])
+    for (q = 0; q < MEM_PAGES; q++)
+      if (mem->write_pages[q] == base)
+        guard(c, q, d);
+  return d;
+}
+
+/* decode from pc to the end of its block or page, or until something
+ * that's already been decoded */
+static void decode_block (cpu *c, decoded_page *d, addr pc) {
+  byte *base = d->base;
+  decoded_op *e;
+  int i = pc & (MEM_PAGE_SIZE - 1), k;
+
+  while (i < MEM_PAGE_SIZE && !d->ops[i].size) {
+    e = &d->ops[i];
+    e->op = base[i];
+    e->size = size_table[e->op] ? size_table[e->op] : 1;
+    e->arg = 0;
+    if (i + e->size > MEM_PAGE_SIZE) {
+      e->size = SPLIT;
+      break;
+    }
+    for (k = e->size - 1; k > 0; k--)
+      e->arg = e->arg << 8 | base[i + k];
+    if (ends_block(e->op))
+      break;
+    i += e->size;
+  }
+}
+
+/* the opcode at PC, with the bytes after it in c->arg */
+static inline byte fetch (cpu *c) {
+  memory *mem = c->mem;
+  int p = c->PC >> MEM_PAGE_BITS, k;
+  decoded_page *d;
+  decoded_op *e;
+  byte op;
+
+  if (c->code_changes != mem->changes)
+    remap(c);
+  d = c->code[p];
+  if (d || (d = code_page(c, p))) {
+    e = &d->ops[c->PC & (MEM_PAGE_SIZE - 1)];
+    if (!e->size)
+      decode_block(c, d, c->PC);
+    if (e->size != SPLIT) {
+      c->arg = e->arg;
+      return e->op;
+    }
+  }
+
+  /* straight from memory */
+  op = mem_read(mem, c->PC);
+  c->arg = 0;
+  for (k = (size_table[op] ? size_table[op] : 1) - 1; k > 0; k--)
+    c->arg = c->arg << 8 | mem_read(mem, c->PC + k);
+  return op;
+}
+
+
 /* 
  * ---------- user functions ---------- 
  */
@@ -732,12 +1123,14 @@ void cpu_init (nes *n) {
   cpu *c = n->c;
   /* initialize memory */
   c->mem = malloc(sizeof(memory));
-  mem_init(c->mem, 0x10000, n);
-  /* set up memory mirrors */
-  mem_mirror(c->mem, 0x0000, 0x1fff, 0x0800);
-  mem_mirror(c->mem, 0x2000, 0x3fff, 0x0008);
-
-  /* only these flags are guaranteed at startup */
+  /* 2K of work ram, mirrored up to $1fff */
+  mem_init(c->mem, 0x0800, n);
+  /* nothing else is there until i/o and a cartridge are hooked up */
+  mem_map_io(c->mem, 0x2000, 0xffff, NULL, NULL);
+
+  /* only these flags are guaranteed at startup, the rest start clear so
+   * every run from power on is the same */
+  c->P = 0;
   set_flag(c, I, 1);
   set_flag(c, D, 0);
   /* this isn't a flag, but it's always 1 */
@@ -748,6 +1141,19 @@ void cpu_init (nes *n) {
   c->A = 0;
   c->X = 0;
   c->Y = 0;
+  c->cycles = 0;
+  c->nmi = 0;
+  c->irq = 0;
+  c->dma = -1;
+  c->busy = 0;
+
+  /* nothing's been decoded yet */
+  memset(c->code, 0, sizeof(c->code));
+  memset(c->guarded, 0, sizeof(c->guarded));
+  c->decoded_size = 64;
+  c->decoded_count = 0;
+  c->decoded = calloc(c->decoded_size, sizeof(decoded_page *));
+  c->code_changes = c->mem->changes - 1;
 }
 
 void cpu_load (nes *n) {
@@ -759,7 +1165,7 @@ void cpu_load (nes *n) {
   /* c->PC = 0xc000; */
 }
 
-void NMI (cpu *c) {
+static void NMI (cpu *c) {
   byte lo, hi;
   /* push PC then P onto the stack */
   /* bit 5 is always set when pushed to the stack */
@@ -769,249 +1175,109 @@ void NMI (cpu *c) {
   lo = mem_read(c->mem, 0xfffa);
   hi = mem_read(c->mem, 0xfffb);
 
-  printf("NMI occured to 0x%04x\n",((addr)(hi) << 8) | lo );
-
   c->PC = ((addr)(hi) << 8) | lo;
 }
 
+static void IRQ (cpu *c) {
+  byte lo, hi;
+  /* same as BRK, but the B flag is clear and the PC isn't skipped ahead */
+  push_word(c, c->PC);
+  push_byte(c, (c->P & ~0x10) | 0x20);
+  set_flag(c, I, 1);
+  lo = mem_read(c->mem, 0xfffe);
+  hi = mem_read(c->mem, 0xffff);
+
+  c->PC = ((addr)(hi) << 8) | lo;
+}
 
-/* returns 0 on successful execution of a single instruction */
-void cpu_step (nes *n) {
+/* executes a single instruction (or interrupt) and returns the number
+ * of cycles it took */
+int cpu_step (nes *n) {
   byte op;
+  int cycles;
   cpu *c = n->c;
 
-  //printf("status: %02x, ctrl: %02x\n", n->p->status, n->p->ctrl);
-  if (n->p->status & n->p->ctrl & 0x80) {
+  if (c->nmi) {
+    c->nmi = 0;
     NMI(c);
-    return;
+    c->cycles += 7;
+    return 7;
+  }
+  if (c->irq && !get_flag(c, I)) {
+    IRQ(c);
+    c->cycles += 7;
+    return 7;
   }
 
-  op = mem_read(c->mem, c->PC);
+  op = fetch(c);
+  c->op = op;
+  c->busy = 1;
+  c->extra = 0;
+  c->crossed = 0;
 
-  printf("%04X  %02X A:%02X X:%02X Y:%02X P:%02X SP:%02X\n",
-         c->PC, op, c->A, c->X, c->Y, c->P, c->SP);
+  TRACE(n, op);
 
   c->PC++;
 
-  /* alphabetical by instruction */
-  switch (op) {
-    /* ADC */
-  case 0x69: ADC(c, am_imm(c));        break;
-  case 0x65: ADC(c, am_zer(c));        break;
-  case 0x75: ADC(c, am_zex(c));      break;
-  case 0x6d: ADC(c, am_abs(c));         break; 
-  case 0x7d: ADC(c, am_abx(c));       break;
-  case 0x79: ADC(c, am_aby(c));       break;
-  case 0x61: ADC(c, am_inx(c)); break;
-  case 0x71: ADC(c, am_iny(c)); break;
-    /* AND */
-  case 0x29: AND(c, am_imm(c));        break;
-  case 0x25: AND(c, am_zer(c));        break;
-  case 0x35: AND(c, am_zex(c));      break;
-  case 0x2d: AND(c, am_abs(c));         break; 
-  case 0x3d: AND(c, am_abx(c));       break;
-  case 0x39: AND(c, am_aby(c));       break;
-  case 0x21: AND(c, am_inx(c)); break;
-  case 0x31: AND(c, am_iny(c)); break;
-    /* ASL */
-  case 0x0a: ASLa(c);      break;
-  case 0x06: ASL(c, am_zer(c));        break;
-  case 0x16: ASL(c, am_zex(c));      break;
-  case 0x0e: ASL(c, am_abs(c));         break; 
-  case 0x1e: ASL(c, am_abx(c));       break;
-    /* BIT */
-  case 0x24: BIT(c, am_zer(c));        break;
-  case 0x2c: BIT(c, am_abs(c));         break;
-    /* branches */
-  case 0x10: BPL(c, am_rel(c));         break;
-  case 0x30: BMI(c, am_rel(c));         break;
-  case 0x50: BVC(c, am_rel(c));         break;
-  case 0x70: BVS(c, am_rel(c));         break;
-  case 0x90: BCC(c, am_rel(c));         break;
-  case 0xb0: BCS(c, am_rel(c));         break;
-  case 0xd0: BNE(c, am_rel(c));         break;
-  case 0xf0: BEQ(c, am_rel(c));         break;
-    /* BRK */
-  case 0x00: BRK(c); /* implied operand */     break;
-    /* CMP */
-  case 0xc9: CMP(c, am_imm(c));        break;
-  case 0xc5: CMP(c, am_zer(c));        break;
-  case 0xd5: CMP(c, am_zex(c));      break;
-  case 0xcd: CMP(c, am_abs(c));         break; 
-  case 0xdd: CMP(c, am_abx(c));       break;
-  case 0xd9: CMP(c, am_aby(c));       break;
-  case 0xc1: CMP(c, am_inx(c)); break;
-  case 0xd1: CMP(c, am_iny(c)); break;
-    /* CPX */
-  case 0xe0: CPX(c, am_imm(c));        break;
-  case 0xe4: CPX(c, am_zer(c));        break;
-  case 0xec: CPX(c, am_abs(c));         break;
-    /* CPY */
-  case 0xc0: CPY(c, am_imm(c));        break;
-  case 0xc4: CPY(c, am_zer(c));        break;
-  case 0xcc: CPY(c, am_abs(c));         break;
-    /* DEC */
-  case 0xc6: DEC(c, am_zer(c));        break;
-  case 0xd6: DEC(c, am_zex(c));      break;
-  case 0xce: DEC(c, am_abs(c));         break;
-  case 0xde: DEC(c, am_abx(c));       break;
-    /* EOR */
-  case 0x49: EOR(c, am_imm(c));        break;
-  case 0x45: EOR(c, am_zer(c));        break;
-  case 0x55: EOR(c, am_zex(c));      break;
-  case 0x4d: EOR(c, am_abs(c));         break; 
-  case 0x5d: EOR(c, am_abx(c));       break;
-  case 0x59: EOR(c, am_aby(c));       break;
-  case 0x41: EOR(c, am_inx(c)); break;
-  case 0x51: EOR(c, am_iny(c)); break;
-    /* status flag operations */
-  case 0x18: CLC(c); /* implied operand */     break;
-  case 0x38: SEC(c); /* implied operand */     break;
-  case 0x58: CLI(c); /* implied operand */     break;
-  case 0x78: SEI(c); /* implied operand */     break;
-  case 0xb8: CLV(c); /* implied operand */     break;
-  case 0xd8: CLD(c); /* implied operand */     break;
-  case 0xf8: SED(c); /* implied operand */     break;
-    /* INC */
-  case 0xe6: INC(c, am_zer(c));        break;
-  case 0xf6: INC(c, am_zex(c));      break;
-  case 0xee: INC(c, am_abs(c));         break;
-  case 0xfe: INC(c, am_abx(c));       break;
-    /* JMP */
-  case 0x4c: JMP(c, am_abs(c));         break;
-  case 0x6c: JMP(c, am_ind(c));         break;
-    /* JSR */
-  case 0x20: JSR(c, am_abs(c));         break;
-    /* LDA */
-  case 0xa9: LDA(c, am_imm(c));        break;
-  case 0xa5: LDA(c, am_zer(c));        break;
-  case 0xb5: LDA(c, am_zex(c));      break;
-  case 0xad: LDA(c, am_abs(c));         break; 
-  case 0xbd: LDA(c, am_abx(c));       break;
-  case 0xb9: LDA(c, am_aby(c));       break;
-  case 0xa1: LDA(c, am_inx(c)); break;
-  case 0xb1: LDA(c, am_iny(c)); break;
-    /* LDX */
-  case 0xa2: LDX(c, am_imm(c));        break;
-  case 0xa6: LDX(c, am_zer(c));        break;
-  case 0xb6: LDX(c, am_zey(c));      break;
-  case 0xae: LDX(c, am_abs(c));         break;
-  case 0xbe: LDX(c, am_aby(c));       break;
-    /* LDY */
-  case 0xa0: LDY(c, am_imm(c));        break;
-  case 0xa4: LDY(c, am_zer(c));        break;
-  case 0xb4: LDY(c, am_zex(c));      break;
-  case 0xac: LDY(c, am_abs(c));         break;
-  case 0xbc: LDY(c, am_abx(c));       break;
-    /* LSR */
-  case 0x4a: LSRa(c);      break;
-  case 0x46: LSR(c, am_zer(c));        break;
-  case 0x56: LSR(c, am_zex(c));      break;
-  case 0x4e: LSR(c, am_abs(c));         break;
-  case 0x5e: LSR(c, am_abx(c));       break;
-    /* NOP and it's extra illegal codes */
-  case 0x1a:
-  case 0x3a:
-  case 0x5a:
-  case 0x7a:
-  case 0xda:
-  case 0xfa:
-  case 0xea: NOP(c); /* implied operand */     break;
-    /* ORA */
-  case 0x09: ORA(c, am_imm(c));        break;
-  case 0x05: ORA(c, am_zer(c));        break;
-  case 0x15: ORA(c, am_zex(c));      break;
-  case 0x0d: ORA(c, am_abs(c));         break; 
-  case 0x1d: ORA(c, am_abx(c));       break;
-  case 0x19: ORA(c, am_aby(c));       break;
-  case 0x01: ORA(c, am_inx(c)); break;
-  case 0x11: ORA(c, am_iny(c)); break;
-    /* register instructions */
-  case 0xaa: TAX(c); /* implied operand */     break;
-  case 0x8a: TXA(c); /* implied operand */     break;
-  case 0xca: DEX(c); /* implied operand */     break;
-  case 0xe8: INX(c); /* implied operand */     break;
-  case 0xa8: TAY(c); /* implied operand */     break;
-  case 0x98: TYA(c); /* implied operand */     break;
-  case 0x88: DEY(c); /* implied operand */     break;
-  case 0xc8: INY(c); /* implied operand */     break;
-    /* ROL */
-  case 0x2a: ROLa(c);      break;
-  case 0x26: ROL(c, am_zer(c));        break;
-  case 0x36: ROL(c, am_zex(c));      break;
-  case 0x2e: ROL(c, am_abs(c));         break;
-  case 0x3e: ROL(c, am_abx(c));       break;
-    /* ROR */
-  case 0x6a: RORa(c);      break;
-  case 0x66: ROR(c, am_zer(c));        break;
-  case 0x76: ROR(c, am_zex(c));      break;
-  case 0x6e: ROR(c, am_abs(c));         break;
-  case 0x7e: ROR(c, am_abx(c));       break;
-    /* RTI */
-  case 0x40: RTI(c); /* implied operand */     break;
-    /* RTS */
-  case 0x60: RTS(c); /* implied operand */     break;
-    /* SBC */
-  case 0xe9: SBC(c, am_imm(c));        break;
-  case 0xe5: SBC(c, am_zer(c));        break;
-  case 0xf5: SBC(c, am_zex(c));      break;
-  case 0xed: SBC(c, am_abs(c));         break; 
-  case 0xfd: SBC(c, am_abx(c));       break;
-  case 0xf9: SBC(c, am_aby(c));       break;
-  case 0xe1: SBC(c, am_inx(c)); break;
-  case 0xf1: SBC(c, am_iny(c)); break;
-    /* STA */
-  case 0x85: STA(c, am_zer(c));        break;
-  case 0x95: STA(c, am_zex(c));      break;
-  case 0x8d: STA(c, am_abs(c));         break; 
-  case 0x9d: STA(c, am_abx(c));       break;
-  case 0x99: STA(c, am_aby(c));       break;
-  case 0x81: STA(c, am_inx(c)); break;
-  case 0x91: STA(c, am_iny(c)); break;
-    /* stack instructions */
-  case 0x9a: TXS(c); /* implied operand */     break;
-  case 0xba: TSX(c); /* implied operand */     break;
-  case 0x48: PHA(c); /* implied operand */     break;
-  case 0x68: PLA(c); /* implied operand */     break;
-  case 0x08: PHP(c); /* implied operand */     break;
-  case 0x28: PLP(c); /* implied operand */     break;
-    /* STX */
-  case 0x86: STX(c, am_zer(c));        break;
-  case 0x96: STX(c, am_zey(c));      break;
-  case 0x8e: STX(c, am_abs(c));         break;
-    /* STY */
-  case 0x84: STY(c, am_zer(c));        break;
-  case 0x94: STY(c, am_zex(c));      break;
-  case 0x8c: STY(c, am_abs(c));         break;
-    /* illegal opcodes go to SKB skip byte / SKW skip word */
-  case 0x80:
-  case 0x82:
-  case 0xc2:
-  case 0xe2:
-  case 0x04:
-  case 0x14:
-  case 0x34:
-  case 0x44:
-  case 0x54:
-  case 0x64:
-  case 0x74:
-  case 0xd4:
-  case 0xf4: SKB(c); /* implied operand */     break;
-  case 0x0c:
-  case 0x1c:
-  case 0x3c:
-  case 0x5c:
-  case 0x7c:
-  case 0xdc:
-  case 0xfc: SKW(c); /* implied operand */     break;
-
-    /* error */
-  default: 
-    /* invalid op, returning it so we can solve it or crash */
-    printf("Invalid opcode: 0x%02x\n", op);
+#ifdef CPU_THREADED
+#define LABEL(code, ins, mode) [code] = &&op_##code,
+  static void *const labels[256] = {
+    [0 ... 255] = &&invalid,
+    OPCODES(LABEL)
+  };
+  goto *labels[op];
+#define BODY(code, ins, mode) op_##code: EXEC_##mode(ins); goto done;
+  OPCODES(BODY)
+#else
+  if (!op_table[op])
+    goto invalid;
+  op_table[op](c);
+  goto done;
+#endif
+
+ invalid:
+  /* invalid op, returning it so we can solve it or crash */
+  printf("Invalid opcode: 0x%02x\n", op);
+
+ done:
+  c->busy = 0;
+  cycles = cycle_table[op] + c->extra + (c->crossed & cross_table[op]);
+  c->cycles += cycles;
+  /* a write to $4014 starts a DMA after its last cycle */
+  if (c->dma >= 0) {
+    cycles += ppu_oam_dma(n, c->dma);
+    c->dma = -1;
   }
+  return cycles;
+}
+
+/* the cycle the cpu's on. c->cycles only moves on once an instruction's
+ * done, so in the middle of one this is the cycle of its last bus access,
+ * which is when a load or store reads or writes a register */
+uint64_t cpu_clock (nes *n) {
+  cpu *c = n->c;
+  if (!c->busy)
+    return c->cycles;
+  return c->cycles + cycle_table[c->op] - 1 +
+    (c->crossed & cross_table[c->op]);
+}
+
+/* memory changed behind the cpu's back, like loading a state. Everything
+ * has to be decoded again */
+void cpu_forget_code (nes *n) {
+  cpu *c = n->c;
+  int i;
+  for (i = 0; i < c->decoded_size; i++)
+    if (c->decoded[i])
+      memset(c->decoded[i]->ops, 0, sizeof(c->decoded[i]->ops));
 }
 
 void cpu_destroy (nes *n) {
-  free(n->c->mem);
+  cpu *c = n->c;
+  int i;
+  for (i = 0; i < c->decoded_size; i++)
+    free(c->decoded[i]);
+  free(c->decoded);
+  mem_destroy(c->mem);
+  free(c->mem);
 }
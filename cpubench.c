@@ -0,0 +1,53 @@
+/*
+ * cpubench.c
+ * by Max Willsey
+ * measures how many instructions per second the cpu core runs
+ */
+
+#include "nes.h"
+#include <time.h>
+
+/* nestest's automated mode only uses official opcodes for this long */
+#define RUN_LENGTH 5000
+
+int main (int argc, char **argv) {
+  nes n;
+  cart cart;
+  int rounds, i, r;
+  struct timespec start, end;
+  double secs;
+
+  if (argc < 2) {
+    printf("Usage: %s nestest.nes [rounds]\n", argv[0]);
+    return 1;
+  }
+  rounds = argc > 2 ? atoi(argv[2]) : 2000;
+
+  if (cart_load(&cart, argv[1]))
+    return 1;
+  nes_init(&n);
+  if (nes_insert(&n, &cart))
+    return 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (r = 0; r < rounds; r++) {
+    /* restart the automated test from scratch */
+    for (i = 0; i < 0x800; i++)
+      mem_write(n.c->mem, i, 0);
+    n.c->A = n.c->X = n.c->Y = 0;
+    n.c->P = 0x24;
+    n.c->SP = 0xfd;
+    n.c->PC = 0xc000;
+    for (i = 0; i < RUN_LENGTH; i++)
+      cpu_step(&n);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%d instructions in %.3f s: %.2f million instructions/s\n",
+         rounds * RUN_LENGTH, secs, rounds * RUN_LENGTH / secs / 1e6);
+
+  nes_destroy(&n);
+  cart_unload(&cart);
+  return 0;
+}
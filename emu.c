@@ -1,56 +1,600 @@
+#include <unistd.h>
+#include <time.h>
+
 #include "nes.h"
+/* build with -DHEADLESS to leave out SDL entirely */
+#ifndef HEADLESS
+#include <pthread.h>
 #include "graphics.h"
+#include "sound.h"
+#endif
 
-int main (int argc, char** argv) {
+/* rewind history is kept in this much memory, with a keyframe a second */
+#define REWIND_BUDGET (16 << 20)
+#define REWIND_INTERVAL 60
+
+/* a golden file has a line for every frame of a run that's known to be
+ * right: the ppu's frame number and the hash of what was on screen. Runs
+ * can be checked against it to catch anything that changes the picture,
+ * without keeping every frame */
+typedef struct {
+  FILE *out;                    /* writing one, or NULL when checking */
+  char *file;
+  uint64_t *frames, *hashes;    /* what's expected, when checking */
+  long count, next, first;
+  bit failed;
+} golden;
+
+/* open a golden file to write or check against, returns 0 on success */
+static int golden_open (golden *g, char *file, bit writing) {
+  unsigned long long frame, hash;
+  char line[256];
+  long size = 1024;
   FILE *in;
-  //struct stat in_stat;
-  nes n;
-  tv tv;
 
-  if (argc != 2) {
-    printf("Invalid number of arguments. Please supply just one ROM file.\n");
-    return 1;
+  g->file = file;
+  g->count = g->next = g->first = 0;
+  g->failed = 0;
+  g->frames = g->hashes = NULL;
+  g->out = NULL;
+  if (writing) {
+    g->out = fopen(file, "w");
+    if (!g->out) {
+      printf("Could not open golden file '%s'.\n", file);
+      return -1;
+    }
+    return 0;
   }
 
-  in = fopen(argv[1], "rb");    /* read only binary */
+  in = fopen(file, "r");
   if (!in) {
-    printf("Given file '%s' could not be found.\n", argv[1]);
-    return 1;
+    printf("Could not open golden file '%s'.\n", file);
+    return -1;
   }
+  g->frames = malloc(size * sizeof(uint64_t));
+  g->hashes = malloc(size * sizeof(uint64_t));
+  while (fgets(line, sizeof(line), in)) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "%llu %llx", &frame, &hash) != 2) {
+      printf("'%s' is not a golden file.\n", file);
+      fclose(in);
+      return -1;
+    }
+    if (g->count == size) {
+      size *= 2;
+      g->frames = realloc(g->frames, size * sizeof(uint64_t));
+      g->hashes = realloc(g->hashes, size * sizeof(uint64_t));
+    }
+    g->frames[g->count] = frame;
+    g->hashes[g->count++] = hash;
+  }
+  fclose(in);
+  return 0;
+}
 
-  nes_init(&n);
+/* a run from a save state starts checking after the state's frame */
+static void golden_seek (golden *g, nes *n) {
+  while (g->next < g->count && g->frames[g->next] <= n->p->frames)
+    g->next++;
+  g->first = g->next;
+}
+
+/* checking, there are no frames left to check */
+static bit golden_done (golden *g) {
+  return !g->out && g->next == g->count;
+}
 
-  tv_init(&tv, nes_frame_buffer(&n));
+/* write or check the frame that just finished. returns -1 to stop the
+ * run at the first frame that's wrong */
+static int golden_frame (golden *g, nes *n) {
+  uint64_t hash = nes_frame_hash(n);
+
+  if (g->out) {
+    fprintf(g->out, "%llu %016llx\n", (unsigned long long) n->p->frames,
+            (unsigned long long) hash);
+    return 0;
+  }
+  if (g->next == g->count ||
+      g->frames[g->next] != n->p->frames || g->hashes[g->next] != hash) {
+    if (g->next == g->count)
+      printf("Frame %llu is past the end of '%s'.\n",
+             (unsigned long long) n->p->frames, g->file);
+    else
+      printf("Frame %llu has hash %016llx, '%s' has frame %llu with %016llx.\n",
+             (unsigned long long) n->p->frames, (unsigned long long) hash,
+             g->file, (unsigned long long) g->frames[g->next],
+             (unsigned long long) g->hashes[g->next]);
+    g->failed = 1;
+    return -1;
+  }
+  g->next++;
+  return 0;
+}
 
-  
-  /* TODO: size checking */
-  /* fstat(fileno(in), &in_stat); */
+/* finish with a golden file, returns -1 if the run didn't match it */
+static int golden_close (golden *g) {
+  if (g->out) {
+    fclose(g->out);
+  } else if (!g->failed) {
+    if (g->next < g->count) {
+      printf("Stopped at frame %llu, '%s' goes on to %llu.\n",
+             (unsigned long long) g->frames[g->next] - 1, g->file,
+             (unsigned long long) g->frames[g->count - 1]);
+      g->failed = 1;
+    } else {
+      printf("All %ld frames match '%s'.\n", g->count - g->first, g->file);
+    }
+  }
+  free(g->frames);
+  free(g->hashes);
+  return g->failed ? -1 : 0;
+}
 
-  /* if (in_stat.st_size < 0x4000)    /\* less than 16kB *\/ */
-  /*   fread(nes_cpu.cartidge_upper_bank, sizeof(byte), in_stat.st_size, in); */
-  /* else if (in_stat.st_size < 0x8000)    /\* less than 32kB *\/ */
-  /*   fread(nes_cpu.cartidge_lower_bank, sizeof(byte), in_stat.st_size, in); */
+/* run as fast as possible without a window and report the speed. With a
+ * movie playing, or a golden file to check, frames can be 0 to run until
+ * it ends */
+void run_headless (nes *n, long frames, rewind_buf *r, movie *m, golden *g) {
+  struct timespec start, end;
+  double secs;
+  long i;
 
-  /* for the nestest rom */
-  fseek(in, 16, SEEK_SET);
-  fread(n.upper_bank, sizeof(byte), 0x4000, in);
-  fread(n.chr_rom, sizeof(byte), 0x2000, in);
-  cpu_load(&n);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; !frames || i < frames; i++) {
+    if (m && movie_frame(m, n))
+      break;
+    if (!frames && !m && g && golden_done(g))
+      break;
+    nes_frame(n);
+    if (r)
+      rewind_push(r, n);
+    if (g && golden_frame(g, n))
+      break;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%ld frames in %.3f s: %.1f frames/s\n", i, secs, i / secs);
+  if (r)
+    printf("rewind: %d frames in %zu bytes\n", r->count, rewind_used(r));
+}
+
+/* go back frames frames from the last one run. The last one pushed is the
+ * frame we're on, so that's one more pop. returns -1 if the history
+ * doesn't go back that far */
+static int rewind_back (rewind_buf *r, nes *n, int frames) {
+  int i;
+  for (i = 0; i <= frames; i++) {
+    if (rewind_pop(r, n)) {
+      printf("Only %d frames of rewind history.\n", i ? i - 1 : 0);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* step until the trace has checked every instruction against its log, or
+ * one didn't match. returns -1 if one didn't */
+int run_check (nes *n, char *file) {
+  struct timespec start, end;
+  trace *t = n->trace;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!t->done && !t->failed)
+    nes_step(n);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (t->failed)
+    return -1;
+  printf("All %llu instructions match '%s', in %.3f s.\n",
+         (unsigned long long) t->matched, file, secs);
+  return 0;
+}
+
+#ifndef HEADLESS
+/* NTSC runs at 60.0988 frames a second */
+#define FRAME_NS 16639267L
+
+/* sound queued up ahead of the speakers */
+#define SOUND_LATENCY_MS 50
+
+/* what the emulator thread and the window share */
+typedef struct {
+  nes *n;
+  tv *tv;
+  rewind_buf *r;
+  apu *a;                       /* NULL when there's no sound */
+  movie *m;                     /* recording or playing, or NULL */
+  bit movie_over;               /* played to the end, the keyboard's back */
+  long frames;
+  atomic_int pads;              /* buttons held on the keyboard */
+  atomic_int quit;              /* window closed */
+  atomic_int rewinding;         /* backspace held */
+  atomic_int done;              /* emulator thread finished */
+} session;
+
+/* set the controllers for the next frame, from the keyboard or a movie */
+static void next_input (session *s, nes *n) {
+  n->pads[0] = atomic_load(&s->pads);
+  /* a movie that's finished hands over to the keyboard, but it's kept in
+   * case we rewind back into it. The keyboard is only the first pad, so
+   * the second lets go of what the movie last held */
+  if (s->m && movie_frame(s->m, n)) {
+    n->pads[1] = 0;
+    if (!s->movie_over) {
+      printf("Movie finished at frame %llu.\n", (unsigned long long) n->p->frames);
+      s->movie_over = 1;
+    }
+  }
+}
+
+/* emulator thread: runs frames at the real speed and hands them over. The
+ * speed comes from the sound card when there's sound, the clock if not */
+void *run_emulator (void *arg) {
+  session *s = arg;
+  nes *n = s->n;
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load(&s->quit) &&
+         (!s->frames || n->p->frames < (uint64_t)s->frames)) {
+    if (s->r && atomic_load(&s->rewinding)) {
+      /* the frame buffer isn't in the state, so show the one it leads to.
+       * That frame already ran, so its input comes from the movie, or the
+       * state, and nothing new gets recorded */
+      if (!rewind_pop(s->r, n)) {
+        if (s->m)
+          movie_replay(s->m, n);
+        nes_frame(n);
+      }
+    } else {
+      next_input(s, n);
+      nes_frame(n);
+      if (s->r)
+        rewind_push(s->r, n);
+    }
+    tv_submit(s->tv, nes_frame_buffer(n));
+
+    if (s->a) {
+      /* the sound card's clock paces us. Wait for it to play down to half
+       * a frame under the target, so the ring averages out there and the
+       * apu's rate control has nothing left to correct */
+      while (!atomic_load(&s->quit) &&
+             (int) apu_queued(s->a) > (int) s->a->target - s->a->rate / 120)
+        usleep(1000);
+      continue;
+    }
+    next.tv_nsec += FRAME_NS;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  atomic_store(&s->done, 1);
+  return NULL;
+}
 
-  int i = 0;
+/* the keys for each button of the first controller */
+static const struct {
+  SDL_Scancode key;
+  byte button;
+} keymap[] = {
+  {SDL_SCANCODE_X, PAD_A},
+  {SDL_SCANCODE_Z, PAD_B},
+  {SDL_SCANCODE_RSHIFT, PAD_SELECT},
+  {SDL_SCANCODE_RETURN, PAD_START},
+  {SDL_SCANCODE_UP, PAD_UP},
+  {SDL_SCANCODE_DOWN, PAD_DOWN},
+  {SDL_SCANCODE_LEFT, PAD_LEFT},
+  {SDL_SCANCODE_RIGHT, PAD_RIGHT}
+};
 
+static byte read_keys (const Uint8 *keys) {
+  byte pads = 0;
+  unsigned i;
+  for (i = 0; i < sizeof(keymap) / sizeof(keymap[0]); i++)
+    if (keys[keymap[i].key])
+      pads |= keymap[i].button;
+  return pads;
+}
+
+/* run in a window until it's closed or we've done enough frames. Holding
+ * backspace rewinds, if there's history. The emulator gets its own thread
+ * and this one just shows frames as they're finished */
+void run_tv (nes *n, long frames, rewind_buf *r, movie *m, int scale,
+             int use_surface, int quiet) {
+  static tv tv;
+  sound sound;
+  session s;
+  pthread_t thread;
   SDL_Event e;
+  const Uint8 *keys;
+
+  tv_init(&tv, scale, use_surface);
+  keys = SDL_GetKeyboardState(NULL);
+
+  s.n = n;
+  s.tv = &tv;
+  s.r = r;
+  s.m = m;
+  s.movie_over = 0;
+  s.a = !quiet && !sound_init(&sound, n, SOUND_LATENCY_MS) ? n->a : NULL;
+  s.frames = frames;
+  atomic_init(&s.pads, 0);
+  atomic_init(&s.quit, 0);
+  atomic_init(&s.rewinding, 0);
+  atomic_init(&s.done, 0);
+  pthread_create(&thread, NULL, &run_emulator, &s);
+
+  while (!atomic_load(&s.done)) {
+    /* with vsync, presenting paces this loop. Otherwise wait a little for
+     * something to happen rather than spin */
+    if (tv.vsync ? SDL_PollEvent(&e) : SDL_WaitEventTimeout(&e, 2)) {
+      do {
+        if (e.type == SDL_QUIT)
+          atomic_store(&s.quit, 1);
+      } while (SDL_PollEvent(&e));
+    }
+    atomic_store(&s.rewinding, keys[SDL_SCANCODE_BACKSPACE]);
+    atomic_store(&s.pads, read_keys(keys));
+    tv_update(&tv);
+  }
+  pthread_join(thread, NULL);
+  if (s.a)
+    sound_destroy(&sound);
+  tv_destroy(&tv);
+}
+#endif
+
+/* write out the raw palette indices of the last frame */
+int dump_frame (nes *n, char *file) {
+  FILE *out = fopen(file, "wb");
+  if (!out) {
+    printf("Could not open output file '%s'.\n", file);
+    return 1;
+  }
+  fwrite(nes_frame_buffer(n), sizeof(byte), 256 * 240, out);
+  fclose(out);
+  return 0;
+}
+
+int main (int argc, char** argv) {
+  nes n;
+  cart cart;
+  char *trace_file = NULL;
+  char *dump_file = NULL;
+  char *load_file = NULL;
+  char *save_file = NULL;
+  char *record_file = NULL;
+  char *play_file = NULL;
+  char *golden_file = NULL;
+  char *check_file = NULL;
+  FILE *expect = NULL;
+  uint64_t check_lines = 0;
+  long start_pc = -1;
+  bit golden_write = 0;
+  golden golden, *g = NULL;
+  movie movie, *m = NULL;
+  rewind_buf rewind, *r = NULL;
+  int rewind_secs = 0;
+  int rewind_frames = 0;
+#ifndef HEADLESS
+  int scale = 2;
+  bit use_surface = 0;
+  bit quiet = 0;
+#endif
+  long frames = 0;
+#ifdef HEADLESS
+  bit headless = 1;
+#else
+  bit headless = 0;
+#endif
+  int opt;
 
-  while (1) {
-    i++;
-    nes_step(&n);
-    if (i % 100 == 0) {
-      SDL_PollEvent(&e);
-      if (e.type == SDL_QUIT)
-        break;
-      tv_update(&tv);
+  while ((opt = getopt(argc, argv, "Hf:o:t:L:S:R:B:z:Wqr:p:g:G:c:n:s:")) != -1) {
+    switch (opt) {
+    case 'H':
+      /* no window, just run */
+      headless = 1;
+      break;
+    case 'f':
+      /* stop after this many frames */
+      frames = atol(optarg);
+      break;
+    case 'o':
+      /* dump the last frame to this file */
+      dump_file = optarg;
+      break;
+    case 't':
+      /* trace every instruction to this file */
+      trace_file = optarg;
+      break;
+    case 'L':
+      /* start from a save state */
+      load_file = optarg;
+      break;
+    case 'S':
+      /* save the state at the end */
+      save_file = optarg;
+      break;
+    case 'R':
+      /* keep this many seconds of rewind history */
+      rewind_secs = atoi(optarg);
+      break;
+    case 'B':
+      /* rewind this many frames at the end, before saving */
+      rewind_frames = atoi(optarg);
+      break;
+#ifndef HEADLESS
+    case 'z':
+      /* window size, as a multiple of the screen */
+      scale = atoi(optarg);
+      break;
+    case 'W':
+      /* draw on the window surface instead of through a renderer */
+      use_surface = 1;
+      break;
+    case 'q':
+      /* no sound */
+      quiet = 1;
+      break;
+#endif
+    case 'r':
+      /* record the controllers to this movie */
+      record_file = optarg;
+      break;
+    case 'p':
+      /* play the controllers back from this movie */
+      play_file = optarg;
+      break;
+    case 'g':
+      /* check every frame against a golden file */
+      golden_file = optarg;
+      golden_write = 0;
+      break;
+    case 'G':
+      /* write every frame's hash to a golden file */
+      golden_file = optarg;
+      golden_write = 1;
+      break;
+    case 'c':
+      /* check every instruction against a log like nestest.log */
+      check_file = optarg;
+      break;
+    case 'n':
+      /* only check this many lines of it */
+      check_lines = strtoull(optarg, NULL, 10);
+      break;
+    case 's':
+      /* start running here instead of at the reset vector, in hex */
+      start_pc = strtol(optarg, NULL, 16);
+      break;
+    default:
+      printf("Usage: %s [-H] [-f frames] [-o frame dump] [-t trace file] "
+             "[-L load state] [-S save state] [-R rewind seconds] "
+             "[-B rewind frames at the end] "
+             "[-z scale] [-W] [-q] [-r record movie] [-p play movie] "
+             "[-g check golden] [-G write golden] [-c check trace] "
+             "[-n trace lines] [-s start pc] rom\n", argv[0]);
+      return 1;
     }
   }
 
+  if (headless && frames <= 0 && !play_file && !check_file &&
+      (!golden_file || golden_write)) {
+    printf("Running headless needs a number of frames (-f), a movie (-p), "
+           "a golden file (-g) or a trace to check (-c).\n");
+    return 1;
+  }
+  if (golden_file && !headless) {
+    printf("Golden files are only for headless runs (-H).\n");
+    return 1;
+  }
+  if (rewind_frames > 0 && rewind_secs <= 0) {
+    printf("Rewinding at the end (-B) needs rewind history (-R).\n");
+    return 1;
+  }
+  if (record_file && play_file) {
+    printf("Can't record and play a movie at the same time.\n");
+    return 1;
+  }
+
+  if (argc - optind != 1) {
+    printf("Invalid number of arguments. Please supply just one ROM file.\n");
+    return 1;
+  }
+
+  if (cart_load(&cart, argv[optind]))
+    return 1;
+
+  nes_init(&n);
+  if (nes_insert(&n, &cart))
+    return 1;
+
+  if (trace_file || check_file) {
+#ifdef NES_TRACE
+    FILE *out = NULL;
+    if (trace_file && !(out = fopen(trace_file, "w"))) {
+      printf("Could not open trace file '%s'.\n", trace_file);
+      return 1;
+    }
+    n.trace = malloc(sizeof(trace));
+    trace_init(n.trace, 4096, out);
+    if (check_file) {
+      expect = fopen(check_file, "r");
+      if (!expect) {
+        printf("Could not open trace file '%s'.\n", check_file);
+        return 1;
+      }
+      trace_expect(n.trace, expect, check_lines);
+    }
+#else
+    printf("Tracing was not compiled in, rebuild with -DNES_TRACE.\n");
+    return 1;
+#endif
+  }
+
+  cpu_load(&n);
+  if (start_pc >= 0)
+    n.c->PC = start_pc;
+  if (load_file && nes_load_state(&n, load_file))
+    return 1;
+  if (rewind_secs > 0) {
+    if (rewind_init(&rewind, &n, rewind_secs * 60, REWIND_BUDGET, REWIND_INTERVAL))
+      return 1;
+    r = &rewind;
+  }
+  if (record_file || play_file) {
+    if (record_file ? movie_record(&movie, &n, record_file)
+                    : movie_play(&movie, &n, play_file))
+      return 1;
+    m = &movie;
+  }
+  if (golden_file) {
+    if (golden_open(&golden, golden_file, golden_write))
+      return 1;
+    golden_seek(&golden, &n);
+    g = &golden;
+  }
+
+  if (check_file) {
+    if (run_check(&n, check_file))
+      return 1;
+  } else
+#ifndef HEADLESS
+  if (!headless)
+    run_tv(&n, frames, r, m, scale, use_surface, quiet);
+  else
+#endif
+    run_headless(&n, frames, r, m, g);
+
+  if (rewind_frames > 0 && rewind_back(r, &n, rewind_frames))
+    return 1;
+
+  if (dump_file && dump_frame(&n, dump_file))
+    return 1;
+  if (save_file && nes_save_state(&n, save_file))
+    return 1;
+  if (m && movie_close(m))
+    return 1;
+  if (g && golden_close(g))
+    return 1;
+
+  if (n.trace) {
+    trace_destroy(n.trace);
+    if (n.trace->out)
+      fclose(n.trace->out);
+    if (expect)
+      fclose(expect);
+    free(n.trace);
+  }
+
+  if (r)
+    rewind_destroy(r);
+  nes_destroy(&n);
+  cart_unload(&cart);
   return 0;
 }
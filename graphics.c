@@ -4,6 +4,9 @@
  * graphics for a lame NES emulator
  */
 
+#include <stdio.h>
+#include <string.h>
+
 #include "graphics.h"
 
 static const int color_palette[] = {
@@ -18,37 +21,138 @@ static const int color_palette[] = {
 };
 
 
-void tv_init (tv* tv, Uint8 *frame_buffer) {
-  tv->frame_buffer = frame_buffer;
+/* the colors in whatever format the texture or window surface is */
+static void tv_palette (tv* tv) {
+  Uint32 colors[64];
+  int i, c;
+  for (i = 0; i < 64; i++) {
+    c = color_palette[i];
+    if (tv->renderer)
+      colors[i] = 0xff000000 | c;
+    else
+      colors[i] = SDL_MapRGB(tv->screen->format, c >> 16, (c >> 8) & 0xff, c & 0xff);
+  }
+  palette_init(&tv->pal, colors);
+}
+
+/* try for an accelerated renderer that waits for vsync, then any renderer
+ * at all. returns 0 if there isn't one */
+static int tv_renderer (tv* tv) {
+  tv->vsync = 1;
+  tv->renderer = SDL_CreateRenderer(tv->window, -1, SDL_RENDERER_ACCELERATED |
+                                    SDL_RENDERER_PRESENTVSYNC);
+  if (!tv->renderer) {
+    tv->vsync = 0;
+    tv->renderer = SDL_CreateRenderer(tv->window, -1, 0);
+  }
+  if (!tv->renderer)
+    return 0;
+  tv->texture = SDL_CreateTexture(tv->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                  SDL_TEXTUREACCESS_STREAMING, 256, 240);
+  if (!tv->texture) {
+    SDL_DestroyRenderer(tv->renderer);
+    tv->renderer = NULL;
+    return 0;
+  }
+  /* keep the pixels square and sharp at any window size */
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+  SDL_RenderSetLogicalSize(tv->renderer, 256, 240);
+  SDL_RenderSetIntegerScale(tv->renderer, SDL_TRUE);
+  return 1;
+}
+
+/* open a window scale times the size of the screen */
+void tv_init (tv* tv, int scale, int use_surface) {
+  memset(tv->frames, 0, sizeof(tv->frames));
+  tv->back = 0;
+  atomic_init(&tv->middle, 1);
+  tv->front = 2;
+  tv->renderer = NULL;
+  tv->texture = NULL;
+  tv->screen = NULL;
+  tv->vsync = 0;
 
   SDL_Init (SDL_INIT_VIDEO);
+  if (scale < 1 || use_surface)
+    scale = 1;
   tv->window = SDL_CreateWindow("my terrible NES", 
                                 SDL_WINDOWPOS_UNDEFINED, 
                                 SDL_WINDOWPOS_UNDEFINED, 
-                                256, 240, SDL_WINDOW_SHOWN);
-  tv->screen = SDL_GetWindowSurface(tv->window);
+                                256 * scale, 240 * scale,
+                                SDL_WINDOW_SHOWN |
+                                (use_surface ? 0 : SDL_WINDOW_RESIZABLE));
+  if (use_surface || !tv_renderer(tv)) {
+    if (!use_surface)
+      printf("No SDL renderer (%s), drawing on the window.\n", SDL_GetError());
+    tv->screen = SDL_GetWindowSurface(tv->window);
+  }
+  tv_palette(tv);
 }  
 
-void tv_update (tv* tv) {
-  int color;
-  int i, j;
+void tv_destroy (tv* tv) {
+  if (tv->texture)
+    SDL_DestroyTexture(tv->texture);
+  if (tv->renderer)
+    SDL_DestroyRenderer(tv->renderer);
+  SDL_DestroyWindow(tv->window);
+  SDL_Quit();
+}
 
-  int *pixels = (int*)tv->screen->pixels;
+/* emulator thread: hand over a finished frame, and take whichever buffer
+ * isn't in use for the next one */
+void tv_submit (tv* tv, Uint8 *frame_buffer) {
+  memcpy(tv->frames[tv->back], frame_buffer, 256 * 240);
+  tv->back = atomic_exchange(&tv->middle, tv->back | TV_FRESH) & 3;
+}
 
-  for (i = 0; i < 240; i++) {
-    for (j = 0; j < 256; j++) {
-      color = color_palette[tv->frame_buffer[i*256 + j] & 63];
-      pixels[i*256 + j] = 0xff000000 | color;
+/* draw a frame on the window surface */
+static void tv_draw_surface (tv* tv, Uint8 *frame) {
+  SDL_Surface *s = tv->screen;
+  int bpp = s->format->BytesPerPixel;
+  Uint8 *row;
+  int i, j;
+
+  SDL_LockSurface(s);
+  if (bpp == 4) {
+    palette_convert(&tv->pal, s->pixels, s->pitch, frame);
+  } else {
+    /* 16 and 24 bit screens just get a byte copy of each pixel */
+    for (i = 0; i < 240; i++) {
+      row = (Uint8*)s->pixels + i * s->pitch;
+      for (j = 0; j < 256; j++)
+        memcpy(row + j * bpp, &tv->pal.colors[frame[i*256 + j] & 63], bpp);
     }
   }
+  SDL_UnlockSurface(s);
   SDL_UpdateWindowSurface(tv->window);
 }
 
+/* screen thread: show the newest frame if it hasn't been shown yet,
+ * returns whether it did. With vsync this presents every time, which
+ * waits for the next refresh */
+int tv_update (tv* tv) {
+  int fresh = atomic_load(&tv->middle) & TV_FRESH;
+  void *pixels;
+  int pitch;
+
+  if (fresh)
+    tv->front = atomic_exchange(&tv->middle, tv->front) & 3;
+
+  if (!tv->renderer) {
+    if (fresh)
+      tv_draw_surface(tv, tv->frames[tv->front]);
+    return fresh != 0;
+  }
 
-
-
-
-
-
-
-
+  /* the indices go through the palette right into the texture */
+  if (fresh && !SDL_LockTexture(tv->texture, NULL, &pixels, &pitch)) {
+    palette_convert(&tv->pal, pixels, pitch, tv->frames[tv->front]);
+    SDL_UnlockTexture(tv->texture);
+  }
+  if (fresh || tv->vsync) {
+    SDL_RenderClear(tv->renderer);
+    SDL_RenderCopy(tv->renderer, tv->texture, NULL, NULL);
+    SDL_RenderPresent(tv->renderer);
+  }
+  return fresh != 0;
+}
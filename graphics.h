@@ -5,13 +5,32 @@
  */
 
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
 
+#include "palette.h"
+
+/* set in middle when the frame there hasn't been shown yet */
+#define TV_FRESH 4
+
+/* finished frames are handed from the emulator thread to the screen
+ * through three buffers, so neither ever waits on the other */
 typedef struct {
-  Uint8 *frame_buffer;
+  Uint8 frames[3][256 * 240];
+  int back;                     /* being filled by the emulator */
+  atomic_int middle;            /* the newest finished frame */
+  int front;                    /* on the screen */
   SDL_Window *window;
+  /* frames are streamed to a texture and scaled by the renderer, or when
+   * there's no renderer, drawn straight on the window surface */
+  SDL_Renderer *renderer;
+  SDL_Texture *texture;
+  int vsync;                    /* presenting waits for the display */
   SDL_Surface *screen;
+  palette pal;                  /* in the texture or screen's format */
 } tv;
 
 
-void tv_init (tv* tv, Uint8 *frame_buffer);
-void tv_update (tv* tv);
+void tv_init (tv* tv, int scale, int use_surface);
+void tv_submit (tv* tv, Uint8 *frame_buffer);
+int  tv_update (tv* tv);
+void tv_destroy (tv* tv);
@@ -0,0 +1,113 @@
+/*
+ * lockbench.c
+ * by Max Willsey
+ * runs many copies of a rom with different buttons held, in lockstep and
+ * then one at a time, checks they end up the same and compares the speed
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "nes.h"
+
+/* every machine presses its own random buttons, changing this often */
+#define PRESS_FRAMES 15
+
+static double seconds_since (struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* the buttons machine k holds on frame f. Nothing's pressed for the first
+ * second, so they all start out together */
+static byte buttons (int k, long f) {
+  uint32_t x = (k + 1) * 2654435761u ^ (f / PRESS_FRAMES) * 40503u;
+  if (f < 60)
+    return 0;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+int main (int argc, char **argv) {
+  struct timespec start;
+  double herd_secs, alone_secs;
+  int count = 64, bad = 0, opt, k;
+  long frames = 600, f;
+  cart cart;
+  herd h;
+  nes n, *m;
+
+  while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'f':
+      frames = atol(optarg);
+      break;
+    default:
+      printf("Usage: %s [-n machines] [-f frames] rom\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || count < 1 || frames < 1) {
+    printf("Usage: %s [-n machines] [-f frames] rom\n", argv[0]);
+    return 1;
+  }
+  if (cart_load(&cart, argv[optind]))
+    return 1;
+
+  /* all of them together */
+  if (herd_init(&h, count, &cart))
+    return 1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (f = 0; f < frames; f++) {
+    for (k = 0; k < count; k++)
+      h.n[k].pads[0] = buttons(k, f);
+    herd_frame(&h);
+  }
+  herd_secs = seconds_since(&start);
+
+  /* then each on its own, which they have to match */
+  alone_secs = 0;
+  for (k = 0; k < count; k++) {
+    nes_init(&n);
+    if (nes_insert(&n, &cart))
+      return 1;
+    cpu_load(&n);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (f = 0; f < frames; f++) {
+      n.pads[0] = buttons(k, f);
+      nes_frame(&n);
+    }
+    alone_secs += seconds_since(&start);
+
+    herd_export(&h, k);
+    m = &h.n[k];
+    if (nes_frame_hash(m) != nes_frame_hash(&n) ||
+        m->c->cycles != n.c->cycles || m->c->PC != n.c->PC ||
+        m->c->A != n.c->A || m->c->X != n.c->X || m->c->Y != n.c->Y ||
+        m->c->P != n.c->P || m->c->SP != n.c->SP ||
+        memcmp(m->c->mem->ram, n.c->mem->ram, 0x800)) {
+      printf("machine %d doesn't match: cycle %llu PC %04x in lockstep, "
+             "cycle %llu PC %04x alone\n", k,
+             (unsigned long long) m->c->cycles, m->c->PC,
+             (unsigned long long) n.c->cycles, n.c->PC);
+      bad++;
+    }
+    nes_destroy(&n);
+  }
+
+  printf("%d machines, %ld frames each\n", count, frames);
+  printf("lockstep: %.3f s, %.1f frames/s\n", herd_secs, count * frames / herd_secs);
+  printf("alone:    %.3f s, %.1f frames/s\n", alone_secs, count * frames / alone_secs);
+  printf("%.1f%% of instructions run together, %d machines don't match\n",
+         100.0 * h.together / (h.together + h.alone), bad);
+
+  herd_destroy(&h);
+  cart_unload(&cart);
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,933 @@
+/*
+ * lockstep.c
+ * by Max Willsey
+ * runs many machines with the same rom side by side, doing an instruction
+ * for all of them at once wherever they're at the same place in the code
+ */
+
+#include "nes.h"
+
+/* every machine in a herd is a whole nes, but its cpu registers and work
+ * ram live here in lanes, one per machine. Each step, every machine runs
+ * one instruction. The machines at the same PC, with the same code mapped
+ * there, run it as a group with vector operations across their lanes.
+ *
+ * only instructions in rom that touch nothing but the registers and work
+ * ram are done that way. Anything else (i/o, the stack, interrupts, code
+ * in ram, or a machine on its own) goes through cpu_step like a machine
+ * running alone, with its ram reached through callbacks into the lanes.
+ * The ppu, apu and mapper of each machine are its own and run as usual */
+
+/* GCC and clang can do a whole vector of lanes with each operation. Other
+ * compilers get one lane at a time from the same code */
+#if defined(__GNUC__)
+#define VEC_LANES 16
+typedef byte vec __attribute__((vector_size(VEC_LANES)));
+/* comparisons are all 1s in the lanes where they're true */
+#define WHEN(x) ((vec)(x))
+#else
+#define VEC_LANES 1
+typedef byte vec;
+#define WHEN(x) ((vec)-(x))
+#endif
+
+/* what the vector path does for each instruction */
+enum {
+  ALONE,                        /* has to go through cpu_step */
+  LDA, LDX, LDY, STA, STX, STY,
+  AND, ORA, EOR, ADC, SBC, CMP, CPX, CPY, BIT,
+  INC, DEC, ASL, LSR, ROL, ROR,
+  TAX, TAY, TXA, TYA, TSX, TXS, INX, INY, DEX, DEY,
+  CLC, SEC, CLI, SEI, CLV, CLD, SED, NOP,
+  BRA, JMP
+};
+
+/* and where it gets its operand. shifts with imp work on A */
+enum { IMP, IMM, ZER, ZEX, ZEY, ABS, ABX, ABY, REL };
+
+static const byte lengths[] = {1, 2, 2, 2, 2, 3, 3, 3, 2};
+
+/* the opcodes the vector path knows, with their base cycles from cpu.c */
+static const struct {
+  byte ins, mode, cycles;
+} ops[256] = {
+  [0x69] = {ADC, IMM, 2}, [0x65] = {ADC, ZER, 3}, [0x75] = {ADC, ZEX, 4},
+  [0x6d] = {ADC, ABS, 4}, [0x7d] = {ADC, ABX, 4}, [0x79] = {ADC, ABY, 4},
+  [0x29] = {AND, IMM, 2}, [0x25] = {AND, ZER, 3}, [0x35] = {AND, ZEX, 4},
+  [0x2d] = {AND, ABS, 4}, [0x3d] = {AND, ABX, 4}, [0x39] = {AND, ABY, 4},
+  [0x0a] = {ASL, IMP, 2}, [0x06] = {ASL, ZER, 5}, [0x16] = {ASL, ZEX, 6},
+  [0x0e] = {ASL, ABS, 6}, [0x1e] = {ASL, ABX, 7},
+  [0x24] = {BIT, ZER, 3}, [0x2c] = {BIT, ABS, 4},
+  [0x10] = {BRA, REL, 2}, [0x30] = {BRA, REL, 2}, [0x50] = {BRA, REL, 2},
+  [0x70] = {BRA, REL, 2}, [0x90] = {BRA, REL, 2}, [0xb0] = {BRA, REL, 2},
+  [0xd0] = {BRA, REL, 2}, [0xf0] = {BRA, REL, 2},
+  [0xc9] = {CMP, IMM, 2}, [0xc5] = {CMP, ZER, 3}, [0xd5] = {CMP, ZEX, 4},
+  [0xcd] = {CMP, ABS, 4}, [0xdd] = {CMP, ABX, 4}, [0xd9] = {CMP, ABY, 4},
+  [0xe0] = {CPX, IMM, 2}, [0xe4] = {CPX, ZER, 3}, [0xec] = {CPX, ABS, 4},
+  [0xc0] = {CPY, IMM, 2}, [0xc4] = {CPY, ZER, 3}, [0xcc] = {CPY, ABS, 4},
+  [0xc6] = {DEC, ZER, 5}, [0xd6] = {DEC, ZEX, 6}, [0xce] = {DEC, ABS, 6},
+  [0xde] = {DEC, ABX, 7},
+  [0x49] = {EOR, IMM, 2}, [0x45] = {EOR, ZER, 3}, [0x55] = {EOR, ZEX, 4},
+  [0x4d] = {EOR, ABS, 4}, [0x5d] = {EOR, ABX, 4}, [0x59] = {EOR, ABY, 4},
+  [0x18] = {CLC, IMP, 2}, [0x38] = {SEC, IMP, 2}, [0x58] = {CLI, IMP, 2},
+  [0x78] = {SEI, IMP, 2}, [0xb8] = {CLV, IMP, 2}, [0xd8] = {CLD, IMP, 2},
+  [0xf8] = {SED, IMP, 2},
+  [0xe6] = {INC, ZER, 5}, [0xf6] = {INC, ZEX, 6}, [0xee] = {INC, ABS, 6},
+  [0xfe] = {INC, ABX, 7},
+  [0x4c] = {JMP, ABS, 3},
+  [0xa9] = {LDA, IMM, 2}, [0xa5] = {LDA, ZER, 3}, [0xb5] = {LDA, ZEX, 4},
+  [0xad] = {LDA, ABS, 4}, [0xbd] = {LDA, ABX, 4}, [0xb9] = {LDA, ABY, 4},
+  [0xa2] = {LDX, IMM, 2}, [0xa6] = {LDX, ZER, 3}, [0xb6] = {LDX, ZEY, 4},
+  [0xae] = {LDX, ABS, 4}, [0xbe] = {LDX, ABY, 4},
+  [0xa0] = {LDY, IMM, 2}, [0xa4] = {LDY, ZER, 3}, [0xb4] = {LDY, ZEX, 4},
+  [0xac] = {LDY, ABS, 4}, [0xbc] = {LDY, ABX, 4},
+  [0x4a] = {LSR, IMP, 2}, [0x46] = {LSR, ZER, 5}, [0x56] = {LSR, ZEX, 6},
+  [0x4e] = {LSR, ABS, 6}, [0x5e] = {LSR, ABX, 7},
+  [0x1a] = {NOP, IMP, 2}, [0x3a] = {NOP, IMP, 2}, [0x5a] = {NOP, IMP, 2},
+  [0x7a] = {NOP, IMP, 2}, [0xda] = {NOP, IMP, 2}, [0xfa] = {NOP, IMP, 2},
+  [0xea] = {NOP, IMP, 2},
+  [0x09] = {ORA, IMM, 2}, [0x05] = {ORA, ZER, 3}, [0x15] = {ORA, ZEX, 4},
+  [0x0d] = {ORA, ABS, 4}, [0x1d] = {ORA, ABX, 4}, [0x19] = {ORA, ABY, 4},
+  [0xaa] = {TAX, IMP, 2}, [0x8a] = {TXA, IMP, 2}, [0xca] = {DEX, IMP, 2},
+  [0xe8] = {INX, IMP, 2}, [0xa8] = {TAY, IMP, 2}, [0x98] = {TYA, IMP, 2},
+  [0x88] = {DEY, IMP, 2}, [0xc8] = {INY, IMP, 2},
+  [0x2a] = {ROL, IMP, 2}, [0x26] = {ROL, ZER, 5}, [0x36] = {ROL, ZEX, 6},
+  [0x2e] = {ROL, ABS, 6}, [0x3e] = {ROL, ABX, 7},
+  [0x6a] = {ROR, IMP, 2}, [0x66] = {ROR, ZER, 5}, [0x76] = {ROR, ZEX, 6},
+  [0x6e] = {ROR, ABS, 6}, [0x7e] = {ROR, ABX, 7},
+  [0xe9] = {SBC, IMM, 2}, [0xe5] = {SBC, ZER, 3}, [0xf5] = {SBC, ZEX, 4},
+  [0xed] = {SBC, ABS, 4}, [0xfd] = {SBC, ABX, 4}, [0xf9] = {SBC, ABY, 4},
+  [0x85] = {STA, ZER, 3}, [0x95] = {STA, ZEX, 4}, [0x8d] = {STA, ABS, 4},
+  [0x9d] = {STA, ABX, 5}, [0x99] = {STA, ABY, 5},
+  [0x9a] = {TXS, IMP, 2}, [0xba] = {TSX, IMP, 2},
+  [0x86] = {STX, ZER, 3}, [0x96] = {STX, ZEY, 4}, [0x8e] = {STX, ABS, 4},
+  [0x84] = {STY, ZER, 3}, [0x94] = {STY, ZEX, 4}, [0x8c] = {STY, ABS, 4}
+};
+
+/* the flag each branch tests, by the top 2 bits of its opcode. bit 5 of
+ * the opcode says whether it branches on the flag being set */
+static const byte branch_flags[4] = {0x80, 0x40, 0x01, 0x02};
+
+/* the instruction the lanes in a group run, as the first one decoded it */
+typedef struct {
+  byte op, ins, mode, cycles;
+  addr pc, next;                /* where it is, and the one after */
+  addr ea;                      /* its address before indexing */
+  byte imm;
+  byte *code, *code_end;        /* the pages its first and last byte are on */
+} decoded;
+
+/*** lanes ***/
+
+static void *lanes (herd *h, size_t size) {
+  return calloc(h->stride, size);
+}
+
+static inline vec load (const byte *p) {
+  vec v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void store (byte *p, vec v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+/* the lanes of a where m is set, and of b where it isn't */
+static inline vec blend (vec m, vec a, vec b) {
+  return (a & m) | (b & ~m);
+}
+
+/* whether any lane of v is set */
+static inline bit any (vec v) {
+  vec zero = {0};
+  return memcmp(&v, &zero, sizeof(v)) != 0;
+}
+
+/* the Z and N flags for r */
+static inline vec zn (vec r) {
+  return (r & 0x80) | (WHEN(r == 0) & 0x02);
+}
+
+/* the machines' ram, for everything but the vector path */
+static byte ram_read (nes *n, addr a) {
+  return n->herd->ram[(a & 0x7ff) * n->herd->stride + n->lane];
+}
+
+static void ram_write (nes *n, addr a, byte b) {
+  n->herd->ram[(a & 0x7ff) * n->herd->stride + n->lane] = b;
+}
+
+/* the first cycle nes_sync would do something on */
+static uint64_t deadline (nes *n) {
+  uint64_t ppu = n->p->deadline / 3 + (n->p->deadline % 3 != 0);
+  return ppu < n->a->deadline ? ppu : n->a->deadline;
+}
+
+/* an interrupt comes before the next instruction, of a machine on its own
+ * or of lane k in a group */
+static bit cpu_interrupted (cpu *c) {
+  return c->nmi || (c->irq && !(c->P & 0x04));
+}
+
+static bit interrupted (herd *h, int k) {
+  return h->interrupt[k] & 2 || (h->interrupt[k] & 1 && !(h->P[k] & 0x04));
+}
+
+/* lanes with the same banks mapped in at $8000-$ffff get the same number,
+ * so groups can be told apart without comparing maps. Every set of banks
+ * seen is kept, so working a lane's out again when its map changes is one
+ * lookup. Past BANK_SETS of them, a lane gets one nobody else can have */
+#define BANK_SETS 1024
+#define PRG_PAGES (0x8000 >> MEM_PAGE_BITS)
+
+static int lane_banks (herd *h, int k) {
+  memory *mem = h->n[k].c->mem;
+  byte **pages = mem->read_pages + PRG_PAGES;
+  size_t size = PRG_PAGES * sizeof(byte *);
+  uint64_t key = 14695981039346656037ull;
+  int i, s;
+
+  if (h->changes[k] == mem->changes)
+    return h->banks[k];
+  for (i = 0; i < PRG_PAGES; i++)
+    key = (key ^ (uintptr_t)pages[i]) * 1099511628211ull;
+  for (s = (key >> 32) & (2 * BANK_SETS - 1); h->bank_sets[s];
+       s = (s + 1) & (2 * BANK_SETS - 1))
+    if (!memcmp(h->bank_sets[s], pages, size))
+      break;
+  if (!h->bank_sets[s] && h->bank_count < BANK_SETS) {
+    h->bank_sets[s] = malloc(size);
+    memcpy(h->bank_sets[s], pages, size);
+    h->bank_count++;
+  }
+  h->banks[k] = h->bank_sets[s] ? s : 2 * BANK_SETS + k;
+  h->changes[k] = mem->changes;
+  return h->banks[k];
+}
+
+/* move lane k's registers into its machine's cpu, to go on from pc on its
+ * own, and back into the lane to join a group that's run ran cycles */
+static void to_cpu (herd *h, int k, addr pc) {
+  cpu *c = h->n[k].c;
+  c->A = h->A[k];
+  c->X = h->X[k];
+  c->Y = h->Y[k];
+  c->SP = h->SP[k];
+  c->P = h->P[k];
+  c->PC = pc;
+  c->cycles = h->cycles[k];
+}
+
+static void from_cpu (herd *h, int k, uint64_t ran) {
+  cpu *c = h->n[k].c;
+  h->A[k] = c->A;
+  h->X[k] = c->X;
+  h->Y[k] = c->Y;
+  h->SP[k] = c->SP;
+  h->P[k] = c->P;
+  h->cycles[k] = c->cycles - ran;
+  h->deadline[k] = deadline(&h->n[k]);
+  h->interrupt[k] = (c->nmi ? 2 : 0) | (c->irq ? 1 : 0);
+}
+
+/* the ppu only finishes frames when it catches up, so that's when to see
+ * whether a machine's done */
+static void finish (herd *h, int k) {
+  apu_end_frame(&h->n[k]);
+  h->running[k] = 0;
+  h->left--;
+}
+
+/*** together ***/
+
+/* a byte of the instruction being decoded, from whichever of its pages
+ * it's on */
+static byte code_byte (decoded *d, addr a) {
+  byte *page = a >> MEM_PAGE_BITS == d->pc >> MEM_PAGE_BITS ? d->code : d->code_end;
+  return page[a & (MEM_PAGE_SIZE - 1)];
+}
+
+/* work out the instruction at pc in n's memory. returns 0 if the vector
+ * path can't run it: it's not one it knows, or it touches more than the
+ * work ram */
+static bit decode (nes *n, addr pc, decoded *d) {
+  memory *mem = n->c->mem;
+
+  d->code = mem->read_pages[pc >> MEM_PAGE_BITS];
+  if (!d->code)
+    return 0;
+  d->op = d->code[pc & (MEM_PAGE_SIZE - 1)];
+  d->ins = ops[d->op].ins;
+  d->mode = ops[d->op].mode;
+  d->cycles = ops[d->op].cycles;
+  if (d->ins == ALONE)
+    return 0;
+  d->pc = pc;
+  d->next = pc + lengths[d->mode];
+  if (pc < 0x8000 || (addr)(d->next - 1) < 0x8000)
+    return 0;
+  d->code_end = mem->read_pages[(addr)(d->next - 1) >> MEM_PAGE_BITS];
+  if (!d->code_end)
+    return 0;
+
+  d->imm = d->ea = 0;
+  if (d->next - pc > 1)
+    d->imm = d->ea = code_byte(d, pc + 1);
+  if (d->next - pc > 2)
+    d->ea |= (addr)code_byte(d, pc + 2) << 8;
+  switch (d->mode) {
+  case ZER:
+    d->ea &= 0xff;
+    break;
+  case ABS:
+    if (d->ins != JMP && d->ea >= 0x2000)
+      return 0;
+    break;
+  case ABX:
+  case ABY:
+    /* wherever the index takes it, it has to stay in ram */
+    if (d->ea + 0xff >= 0x2000)
+      return 0;
+    break;
+  }
+  return 1;
+}
+
+/*** groups ***/
+
+/* a machine's in a group from when it gets to a place there are enough
+ * others, until it has to run an instruction the vector path can't or its
+ * ppu or apu make it. The group keeps the PC they're all at, and adds up
+ * the cycles they've run, so each step is one instruction for the group
+ * whatever its size. Each lane's cycles only have the group's added in
+ * when the first of them reaches its deadline */
+
+/* a new group, with no lanes yet */
+static herd_group *new_group (herd *h, addr pc, int banks) {
+  herd_group *g = &h->groups[h->group_count++];
+  g->pc = pc;
+  g->banks = banks;
+  g->ran = 0;
+  g->limit = INT64_MAX;
+  g->waiting = 0;
+  g->first = h->stride;
+  g->last = -1;
+  g->size = 0;
+  return g;
+}
+
+/* the first and last of g's lanes, and how many, after some have left */
+static void bounds (herd_group *g) {
+  int first = g->first, last = g->last, k;
+  g->first = INT32_MAX;
+  g->last = -1;
+  g->size = 0;
+  for (k = first; k <= last; k++) {
+    if (!g->mask[k])
+      continue;
+    if (k < g->first)
+      g->first = k;
+    g->last = k;
+    g->size++;
+  }
+}
+
+/* a machine on its own joins g */
+static void join (herd *h, herd_group *g, int k) {
+  int64_t left;
+  from_cpu(h, k, g->ran);
+  g->mask[k] = 0xff;
+  g->size++;
+  if (k < g->first)
+    g->first = k;
+  if (k > g->last)
+    g->last = k;
+  left = h->deadline[k] - h->cycles[k];
+  if (left < g->limit)
+    g->limit = left;
+  h->grouped[k] = 1;
+}
+
+/* and leaves it to go on alone, its registers already in its cpu */
+static void drop (herd *h, herd_group *g, int k) {
+  g->mask[k] = 0;
+  g->size--;
+  h->grouped[k] = 0;
+  if (h->running[k])
+    h->loose[h->loose_count++] = k;
+}
+
+/* or from the lanes, with its cycles added up */
+static void leave (herd *h, herd_group *g, int k) {
+  to_cpu(h, k, g->pc);
+  drop(h, g, k);
+}
+
+/* g at the same place as into, which takes its lanes */
+static void merge (herd *h, herd_group *into, herd_group *g) {
+  int k;
+  for (k = g->first; k <= g->last; k++) {
+    if (!g->mask[k])
+      continue;
+    h->cycles[k] += g->ran - into->ran;
+    into->mask[k] = 0xff;
+    g->mask[k] = 0;
+  }
+  if (g->limit != INT64_MAX && g->limit - (int64_t)g->ran + (int64_t)into->ran < into->limit)
+    into->limit = g->limit - g->ran + into->ran;
+  if (g->first < into->first)
+    into->first = g->first;
+  if (g->last > into->last)
+    into->last = g->last;
+  into->size += g->size;
+  into->waiting |= g->waiting;
+  g->size = 0;
+}
+
+/* everyone goes their own way */
+static void dissolve (herd *h, herd_group *g) {
+  int k;
+  for (k = g->first; k <= g->last; k++) {
+    if (!g->mask[k])
+      continue;
+    h->cycles[k] += g->ran;
+    leave(h, g, k);
+  }
+}
+
+/* the ppu or apu of lane k need a look in */
+static void catch_up (herd *h, herd_group *g, int k) {
+  nes *n = &h->n[k];
+  to_cpu(h, k, g->pc);
+  nes_sync(n);
+  /* the dmc can take cycles */
+  h->cycles[k] = n->c->cycles;
+  h->deadline[k] = deadline(n);
+  h->interrupt[k] = (n->c->nmi ? 2 : 0) | (n->c->irq ? 1 : 0);
+  if (n->p->frames != h->frame[k])
+    finish(h, k);
+}
+
+/* one of g's lanes has reached its deadline. Every lane gets the cycles
+ * the group's run and the ones at their deadlines catch up. Any whose
+ * banks changed or that finished the frame leave, and if an interrupt's
+ * coming for any of them the group takes the next instruction lane by
+ * lane */
+static void flush (herd *h, herd_group *g) {
+  int64_t left;
+  int k;
+
+  g->limit = INT64_MAX;
+  for (k = g->first; k <= g->last; k++) {
+    if (!g->mask[k])
+      continue;
+    h->cycles[k] += g->ran;
+    if (h->cycles[k] >= h->deadline[k])
+      catch_up(h, g, k);
+    if (!h->running[k] || lane_banks(h, k) != g->banks) {
+      leave(h, g, k);
+      continue;
+    }
+    if (interrupted(h, k))
+      g->waiting = 1;
+    left = h->deadline[k] - h->cycles[k];
+    if (left < g->limit)
+      g->limit = left;
+  }
+  g->ran = 0;
+  bounds(g);
+}
+
+/* the lanes of g that didn't take a branch go on to pc as a group of their
+ * own, having run cycles more than the group had */
+static void split (herd *h, herd_group *g, addr pc, int cycles) {
+  herd_group *o = new_group(h, pc, g->banks);
+  vec m, t;
+  int b;
+
+  for (b = g->first - g->first % VEC_LANES; b <= g->last; b += VEC_LANES) {
+    m = load(g->mask + b);
+    t = load(h->taken + b);
+    store(o->mask + b, m & ~t);
+    store(g->mask + b, m & t);
+  }
+  o->ran = g->ran + cycles;
+  o->limit = g->limit;
+  o->waiting = g->waiting;
+  o->first = g->first;
+  o->last = g->last;
+  bounds(o);
+  bounds(g);
+  if ((int64_t)o->ran >= o->limit)
+    flush(h, o);
+}
+
+/* run d on every lane in g */
+static void step_together (herd *h, herd_group *g, decoded *d) {
+  int stride = h->stride, b, k;
+  byte *row = NULL, flag = 0, want = 0, index, jumped;
+  vec m, a, x, y, s, p, v, r, c, t, imm = (vec){0} + d->imm;
+  vec taken = (vec){0}, stayed = (vec){0};
+  bit indexed = d->mode == ZEX || d->mode == ZEY || d->mode == ABX ||
+    d->mode == ABY;
+  bit writes = d->ins == STA || d->ins == STX || d->ins == STY ||
+    ((d->ins == INC || d->ins == DEC || d->ins == ASL || d->ins == LSR ||
+      d->ins == ROL || d->ins == ROR) && d->mode != IMP);
+  bit crosses = (d->mode == ABX || d->mode == ABY) && !writes;
+  int64_t left;
+  addr target;
+
+  /* the operands. With one address it's a row of the ram, otherwise each
+   * lane's is gathered up. A read that crosses a page takes a cycle more,
+   * which is the lane's own */
+  if (d->mode == ZER || (d->mode == ABS && d->ins != JMP))
+    row = h->ram + (d->ea & 0x7ff) * stride;
+  if (indexed) {
+    for (k = g->first; k <= g->last; k++) {
+      if (!g->mask[k])
+        continue;
+      index = d->mode == ZEX || d->mode == ABX ? h->X[k] : h->Y[k];
+      if (d->mode == ZEX || d->mode == ZEY)
+        h->where[k] = (byte)(d->ea + index);
+      else
+        h->where[k] = (d->ea + index) & 0x7ff;
+      h->val[k] = h->ram[h->where[k] * stride + k];
+      if (crosses && (d->ea & 0xff) + index > 0xff) {
+        h->cycles[k]++;
+        left = h->deadline[k] - h->cycles[k];
+        if (left < g->limit)
+          g->limit = left;
+      }
+    }
+    row = h->val;
+  }
+  if (d->ins == BRA) {
+    flag = branch_flags[d->op >> 6];
+    want = d->op & 0x20;
+  }
+
+  for (b = g->first - g->first % VEC_LANES; b <= g->last; b += VEC_LANES) {
+    m = load(g->mask + b);
+    a = load(h->A + b);
+    x = load(h->X + b);
+    y = load(h->Y + b);
+    s = load(h->SP + b);
+    p = load(h->P + b);
+    v = row ? load(row + b) : imm;
+    if (d->mode == IMP)
+      v = a;
+
+    switch (d->ins) {
+    case LDA: a = v; p = (p & 0x7d) | zn(a); break;
+    case LDX: x = v; p = (p & 0x7d) | zn(x); break;
+    case LDY: y = v; p = (p & 0x7d) | zn(y); break;
+    case STA: v = a; break;
+    case STX: v = x; break;
+    case STY: v = y; break;
+    case AND: a &= v; p = (p & 0x7d) | zn(a); break;
+    case ORA: a |= v; p = (p & 0x7d) | zn(a); break;
+    case EOR: a ^= v; p = (p & 0x7d) | zn(a); break;
+    case SBC:
+      /* just the addition on the negated byte */
+      v = ~v;
+      /* fall through */
+    case ADC:
+      t = a + v;
+      r = t + (p & 0x01);
+      c = (WHEN(t < a) | WHEN(r < t)) & 0x01;
+      p = (p & 0x3c) | c | (((a ^ r) & (v ^ r) & 0x80) >> 1) | zn(r);
+      a = r;
+      break;
+    case CMP: p = (p & 0x7c) | (WHEN(a >= v) & 0x01) | zn(a - v); break;
+    case CPX: p = (p & 0x7c) | (WHEN(x >= v) & 0x01) | zn(x - v); break;
+    case CPY: p = (p & 0x7c) | (WHEN(y >= v) & 0x01) | zn(y - v); break;
+    case BIT:
+      p = (p & 0x3d) | (v & 0xc0) | (WHEN((a & v) == 0) & 0x02);
+      break;
+    case INC: v += 1; p = (p & 0x7d) | zn(v); break;
+    case DEC: v -= 1; p = (p & 0x7d) | zn(v); break;
+    case ASL: c = v >> 7; v <<= 1; p = (p & 0x7c) | c | zn(v); break;
+    case LSR: c = v & 0x01; v >>= 1; p = (p & 0x7c) | c | zn(v); break;
+    case ROL:
+      c = v >> 7;
+      v = (v << 1) | (p & 0x01);
+      p = (p & 0x7c) | c | zn(v);
+      break;
+    case ROR:
+      c = v & 0x01;
+      v = (v >> 1) | (p << 7);
+      p = (p & 0x7c) | c | zn(v);
+      break;
+    case TAX: x = a; p = (p & 0x7d) | zn(x); break;
+    case TAY: y = a; p = (p & 0x7d) | zn(y); break;
+    case TXA: a = x; p = (p & 0x7d) | zn(a); break;
+    case TYA: a = y; p = (p & 0x7d) | zn(a); break;
+    case TSX: x = s; p = (p & 0x7d) | zn(x); break;
+    case TXS: s = x; break;
+    case INX: x += 1; p = (p & 0x7d) | zn(x); break;
+    case INY: y += 1; p = (p & 0x7d) | zn(y); break;
+    case DEX: x -= 1; p = (p & 0x7d) | zn(x); break;
+    case DEY: y -= 1; p = (p & 0x7d) | zn(y); break;
+    case CLC: p &= 0xfe; break;
+    case SEC: p |= 0x01; break;
+    case CLI: p &= 0xfb; break;
+    case SEI: p |= 0x04; break;
+    case CLV: p &= 0xbf; break;
+    case CLD: p &= 0xf7; break;
+    case SED: p |= 0x08; break;
+    case BRA:
+      t = want ? WHEN((p & flag) != 0) : WHEN((p & flag) == 0);
+      store(h->taken + b, t & m);
+      taken |= t & m;
+      stayed |= ~t & m;
+      break;
+    }
+    /* shifting the accumulator */
+    if (d->mode == IMP && (d->ins == ASL || d->ins == LSR ||
+                           d->ins == ROL || d->ins == ROR))
+      a = v;
+
+    store(h->A + b, blend(m, a, load(h->A + b)));
+    store(h->X + b, blend(m, x, load(h->X + b)));
+    store(h->Y + b, blend(m, y, load(h->Y + b)));
+    store(h->SP + b, blend(m, s, load(h->SP + b)));
+    store(h->P + b, blend(m, p, load(h->P + b)));
+    if (writes)
+      store(row + b, blend(m, v, load(row + b)));
+  }
+
+  /* indexed writes go back where each lane got them from */
+  if (writes && indexed)
+    for (k = g->first; k <= g->last; k++)
+      if (g->mask[k])
+        h->ram[h->where[k] * stride + k] = h->val[k];
+  h->together += g->size;
+
+  /* where the group goes next, and how long it took. A taken branch costs
+   * 1 extra cycle, and 1 more if it lands on another page. When only some
+   * lanes take it, the rest go on as a group of their own */
+  target = d->ins == JMP ? d->ea : d->next + (int8_t)d->imm;
+  jumped = 0;
+  if (d->ins == BRA && any(taken)) {
+    jumped = 1 + ((target & 0xff00) != (d->next & 0xff00));
+    if (any(stayed))
+      split(h, g, d->next, d->cycles);
+  }
+  g->pc = d->ins == JMP || jumped ? target : d->next;
+  g->ran += d->cycles + jumped;
+  /* an irq that was waiting comes once CLI lets it, so everyone has to
+   * be looked at */
+  if (d->ins == CLI)
+    g->limit = 0;
+  if ((int64_t)g->ran >= g->limit)
+    flush(h, g);
+}
+
+/* g's next instruction can't be run together, or an interrupt comes
+ * first for some of its lanes, so each lane runs it through cpu_step. The
+ * group goes on from where the first lane ends up, and the ones that end
+ * up somewhere else leave */
+static void step_each (herd *h, herd_group *g) {
+  int64_t left;
+  addr pc = 0;
+  int k;
+  nes *n;
+
+  g->limit = INT64_MAX;
+  g->waiting = 0;
+  for (k = g->first; k <= g->last; k++) {
+    if (!g->mask[k])
+      continue;
+    n = &h->n[k];
+    h->cycles[k] += g->ran;
+    to_cpu(h, k, g->pc);
+    nes_step(n);
+    h->alone++;
+    if (n->p->frames != h->frame[k])
+      finish(h, k);
+    if (k == g->first)
+      pc = n->c->PC;
+    if (!h->running[k] || n->c->PC != pc || lane_banks(h, k) != g->banks) {
+      drop(h, g, k);
+      continue;
+    }
+    from_cpu(h, k, 0);
+    if (interrupted(h, k))
+      g->waiting = 1;
+    left = h->deadline[k] - h->cycles[k];
+    if (left < g->limit)
+      g->limit = left;
+  }
+  g->pc = pc;
+  g->ran = 0;
+  bounds(g);
+}
+
+/* fewer machines than this at a place aren't worth a pass over the
+ * vectors, so they go on alone */
+#define MIN_GROUP 4
+
+/* and in a herd smaller than this the groups cost more in joining,
+ * leaving and splitting than they save, so each machine runs alone */
+#define MIN_HERD 32
+
+/* the slot for the place pc with banks mapped, emptied if it's the first
+ * time it's come up this step */
+static herd_slot *place (herd *h, addr pc, int banks) {
+  uint64_t key = ((uint64_t)banks << 16 | pc) * 0x9e3779b97f4a7c15ull;
+  int i = (key >> 40) & h->slot_mask;
+  herd_slot *s;
+
+  for (; h->slots[i].stamp == h->step; i = (i + 1) & h->slot_mask) {
+    s = &h->slots[i];
+    if (s->pc == pc && s->banks == banks)
+      return s;
+  }
+  s = &h->slots[i];
+  s->stamp = h->step;
+  s->pc = pc;
+  s->banks = banks;
+  s->group = -1;
+  s->head = -1;
+  s->count = 0;
+  return s;
+}
+
+/* machine k, on its own, runs an instruction. If the next one can be run
+ * together and there's a group there, or now enough machines on their
+ * own, it joins them. returns 0 if it's still on its own */
+static bit step_alone (herd *h, int k) {
+  nes *n = &h->n[k];
+  herd_slot *s;
+  herd_group *g;
+  decoded d;
+  int j;
+
+  nes_step(n);
+  h->alone++;
+  if (n->p->frames != h->frame[k]) {
+    finish(h, k);
+    return 1;
+  }
+  if (cpu_interrupted(n->c) || !decode(n, n->c->PC, &d))
+    return 0;
+  s = place(h, n->c->PC, lane_banks(h, k));
+  if (s->group >= 0) {
+    join(h, &h->groups[s->group], k);
+    return 1;
+  }
+  h->next[k] = s->head;
+  s->head = k;
+  if (++s->count < MIN_GROUP)
+    return 0;
+  g = new_group(h, s->pc, s->banks);
+  s->group = g - h->groups;
+  for (j = s->head; j >= 0; j = h->next[j])
+    join(h, g, j);
+  return 1;
+}
+
+/* one instruction for every machine still running, and for every group */
+static void herd_step (herd *h) {
+  herd_group *g, swap;
+  herd_slot *s;
+  decoded d;
+  int count, i, j;
+
+  /* a new stamp empties the slots, unless it's come all the way round */
+  if (++h->step == 0) {
+    for (i = 0; i <= h->slot_mask; i++)
+      h->slots[i].stamp = 0;
+    h->step = 1;
+  }
+
+  /* groups that have come to the same place go on as one */
+  for (i = 0; i < h->group_count; i++) {
+    g = &h->groups[i];
+    s = place(h, g->pc, g->banks);
+    if (s->group < 0)
+      s->group = i;
+    else
+      merge(h, &h->groups[s->group], g);
+  }
+
+  /* the ones on their own. Some that stay that way might be in a group by
+   * the end, when enough others caught up to them */
+  count = 0;
+  for (i = 0; i < h->loose_count; i++)
+    if (!step_alone(h, h->loose[i]))
+      h->loose[count++] = h->loose[i];
+  h->loose_count = 0;
+  for (i = 0; i < count; i++)
+    if (!h->grouped[h->loose[i]])
+      h->loose[h->loose_count++] = h->loose[i];
+
+  /* then the groups there were before this step */
+  count = h->group_count;
+  for (i = 0; i < count; i++) {
+    g = &h->groups[i];
+    if (!g->size)
+      continue;
+    if (g->size < MIN_GROUP)
+      dissolve(h, g);
+    else if (g->waiting || !decode(&h->n[g->first], g->pc, &d))
+      step_each(h, g);
+    else
+      step_together(h, g, &d);
+  }
+
+  /* the empty ones go, the rest keep their masks */
+  for (i = j = 0; i < h->group_count; i++) {
+    if (!h->groups[i].size)
+      continue;
+    swap = h->groups[j];
+    h->groups[j++] = h->groups[i];
+    h->groups[i] = swap;
+  }
+  h->group_count = j;
+}
+
+/* run every machine until the ppu finishes the frame it's on. Between
+ * frames, every machine's on its own with its registers in its cpu */
+void herd_frame (herd *h) {
+  int k;
+
+  for (k = 0; k < h->count; k++) {
+    h->running[k] = 1;
+    h->frame[k] = h->n[k].p->frames;
+  }
+  /* too few machines for the groups to pay, so each runs its frame alone */
+  if (h->count < MIN_HERD) {
+    for (k = 0; k < h->count; k++) {
+      while (h->n[k].p->frames == h->frame[k]) {
+        nes_step(&h->n[k]);
+        h->alone++;
+      }
+      apu_end_frame(&h->n[k]);
+    }
+    return;
+  }
+  h->left = h->count;
+  h->loose_count = 0;
+  for (k = 0; k < h->count; k++)
+    h->loose[h->loose_count++] = k;
+  while (h->left)
+    herd_step(h);
+}
+
+/*** setup ***/
+
+/* count machines all running cart from power on. returns 0 on success or
+ * -1 if we can't run it */
+int herd_init (herd *h, int count, cart *cart) {
+  nes *n;
+  int size, k;
+
+  h->count = count;
+  h->stride = (count + VEC_LANES - 1) / VEC_LANES * VEC_LANES;
+  h->A = lanes(h, 1);
+  h->X = lanes(h, 1);
+  h->Y = lanes(h, 1);
+  h->SP = lanes(h, 1);
+  h->P = lanes(h, 1);
+  h->cycles = lanes(h, sizeof(uint64_t));
+  h->deadline = lanes(h, sizeof(uint64_t));
+  h->ram = lanes(h, 0x800);
+  h->interrupt = lanes(h, 1);
+  h->banks = lanes(h, sizeof(int));
+  h->changes = lanes(h, sizeof(unsigned));
+  h->bank_sets = calloc(2 * BANK_SETS, sizeof(byte **));
+  h->bank_count = 0;
+  h->running = lanes(h, 1);
+  h->grouped = lanes(h, 1);
+  h->taken = lanes(h, 1);
+  h->val = lanes(h, 1);
+  h->where = lanes(h, sizeof(addr));
+  h->frame = lanes(h, sizeof(uint64_t));
+  h->loose = lanes(h, sizeof(int));
+  h->next = lanes(h, sizeof(int));
+  /* a group has at least one lane, and the ones emptied in a step are
+   * only cleared out at the end of it */
+  h->groups = calloc(2 * count, sizeof(herd_group));
+  h->masks = lanes(h, 2 * count);
+  for (k = 0; k < 2 * count; k++)
+    h->groups[k].mask = h->masks + k * h->stride;
+  h->group_count = 0;
+  /* at most half the slots are ever in use */
+  for (size = 1; size < 2 * count; size <<= 1)
+    ;
+  h->slot_mask = size - 1;
+  h->slots = calloc(size, sizeof(herd_slot));
+  h->step = 0;
+  h->together = h->alone = 0;
+
+  h->n = calloc(count, sizeof(nes));
+  for (k = 0; k < count; k++) {
+    n = &h->n[k];
+    nes_init(n);
+    if (nes_insert(n, cart)) {
+      h->count = k + 1;
+      herd_destroy(h);
+      return -1;
+    }
+    n->herd = h;
+    n->lane = k;
+    /* the ram's in the lanes */
+    mem_map_io(n->c->mem, 0x0000, 0x1fff, &ram_read, &ram_write);
+    cpu_load(n);
+    /* so its banks are worked out the first time they're needed */
+    h->changes[k] = n->c->mem->changes - 1;
+  }
+  return 0;
+}
+
+/* copy a machine's ram out of the lanes and into the machine, so it can
+ * be looked at or saved like one running alone. Between frames its
+ * registers are already in its cpu */
+void herd_export (herd *h, int lane) {
+  byte *ram = h->n[lane].c->mem->ram;
+  int a;
+  for (a = 0; a < 0x800; a++)
+    ram[a] = h->ram[a * h->stride + lane];
+}
+
+/* and back, after it's been changed, like by loading a state */
+void herd_import (herd *h, int lane) {
+  byte *ram = h->n[lane].c->mem->ram;
+  int a;
+  for (a = 0; a < 0x800; a++)
+    h->ram[a * h->stride + lane] = ram[a];
+}
+
+void herd_destroy (herd *h) {
+  int k;
+  for (k = 0; k < h->count; k++)
+    nes_destroy(&h->n[k]);
+  free(h->n);
+  for (k = 0; k < 2 * BANK_SETS; k++)
+    free(h->bank_sets[k]);
+  free(h->A);
+  free(h->X);
+  free(h->Y);
+  free(h->SP);
+  free(h->P);
+  free(h->cycles);
+  free(h->deadline);
+  free(h->ram);
+  free(h->interrupt);
+  free(h->banks);
+  free(h->changes);
+  free(h->bank_sets);
+  free(h->running);
+  free(h->grouped);
+  free(h->taken);
+  free(h->val);
+  free(h->where);
+  free(h->frame);
+  free(h->loose);
+  free(h->next);
+  free(h->groups);
+  free(h->masks);
+  free(h->slots);
+}
@@ -0,0 +1,310 @@
+/*
+ * mapper.c
+ * by Max Willsey
+ * bank switching hardware on the cartridge
+ */
+
+#include "nes.h"
+
+/*
+ * ---------- bank helpers ----------
+ */
+
+/* banks are numbered in units of the window size. negative banks count
+ * back from the end, so -1 is always the last one */
+
+/* find a bank of size bytes in a rom of total bytes. roms smaller than
+ * the window just get mirrored across it */
+static byte *bank_base (byte *rom, size_t total, int size, int bank) {
+  int banks = total / size;
+  if (!banks)
+    return rom;
+  bank = ((bank % banks) + banks) % banks;
+  return rom + (size_t)bank * size;
+}
+
+/* point a window of the cpu's $8000-$ffff at a bank of prg rom */
+static void map_prg (nes *n, addr start, int size, int bank) {
+  cart *cart = n->cart;
+  mem_map_rom(n->c->mem, start, start + size - 1,
+              bank_base(cart->prg, cart->prg_size, size, bank),
+              size < cart->prg_size ? size : cart->prg_size);
+}
+
+/* point a window of the pattern tables at a bank of chr rom or ram */
+static void map_chr (nes *n, addr start, int size, int bank) {
+  cart *cart = n->cart;
+  byte *old = n->p->mem->read_pages[start >> MEM_PAGE_BITS];
+  if (cart->chr)
+    mem_map_rom(n->p->mem, start, start + size - 1,
+                bank_base(cart->chr, cart->chr_size, size, bank),
+                size < cart->chr_size ? size : cart->chr_size);
+  else
+    mem_map(n->p->mem, start, start + size - 1,
+            bank_base(n->chr_ram, n->chr_ram_size, size, bank),
+            size < n->chr_ram_size ? size : n->chr_ram_size);
+  /* the decoded tiles are stale if a different bank went in */
+  if (n->p->mem->read_pages[start >> MEM_PAGE_BITS] != old)
+    ppu_chr_dirty(n, start, start + size - 1);
+}
+
+/* four screen carts wire up their own vram, so they ignore the mapper */
+static void map_mirroring (nes *n, int mirroring) {
+  if (n->cart->mirroring != MIRROR_FOUR_SCREEN)
+    ppu_mirror(n, mirroring);
+}
+
+
+/*
+ * ---------- NROM (0) ----------
+ */
+
+/* no registers, 16K or 32K of prg and 8K of chr */
+static void nrom_sync (nes *n) {
+  map_prg(n, 0x8000, 0x8000, 0);
+  map_chr(n, 0x0000, 0x2000, 0);
+  map_mirroring(n, n->cart->mirroring);
+}
+
+
+/*
+ * ---------- MMC1 (1) ----------
+ */
+
+/* regs[0] control, regs[1] chr bank 0, regs[2] chr bank 1, regs[3] prg bank.
+ * registers are written a bit at a time through a 5 bit shift register */
+
+static const int mmc1_mirroring[4] = {
+  MIRROR_SINGLE_LOWER, MIRROR_SINGLE_UPPER, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+};
+
+static void mmc1_sync (nes *n) {
+  mapper *m = &n->mapper;
+  byte ctrl = m->regs[0];
+  /* 512K boards use bit 4 of the chr register to pick the 256K prg half */
+  int outer = n->cart->prg_size > 0x40000 ? (m->regs[1] & 0x10) : 0;
+  int prg = outer | (m->regs[3] & 0x0f);
+
+  switch ((ctrl >> 2) & 3) {
+  case 0:
+  case 1:
+    /* switch 32K at $8000 */
+    map_prg(n, 0x8000, 0x8000, prg >> 1);
+    break;
+  case 2:
+    /* first bank fixed at $8000, switch 16K at $c000 */
+    map_prg(n, 0x8000, 0x4000, outer);
+    map_prg(n, 0xc000, 0x4000, prg);
+    break;
+  case 3:
+    /* switch 16K at $8000, last bank fixed at $c000 */
+    map_prg(n, 0x8000, 0x4000, prg);
+    map_prg(n, 0xc000, 0x4000, outer | 0x0f);
+    break;
+  }
+
+  if (ctrl & 0x10) {
+    /* two 4K chr banks */
+    map_chr(n, 0x0000, 0x1000, m->regs[1]);
+    map_chr(n, 0x1000, 0x1000, m->regs[2]);
+  } else {
+    /* one 8K chr bank */
+    map_chr(n, 0x0000, 0x2000, m->regs[1] >> 1);
+  }
+
+  map_mirroring(n, mmc1_mirroring[ctrl & 3]);
+}
+
+static void mmc1_write (nes *n, addr a, byte b) {
+  mapper *m = &n->mapper;
+  if (b & 0x80) {
+    /* reset the shift register and lock the last prg bank at $c000 */
+    m->shift = 0;
+    m->shift_count = 0;
+    m->regs[0] |= 0x0c;
+  } else {
+    m->shift |= (b & 1) << m->shift_count++;
+    if (m->shift_count < 5)
+      return;
+    /* the fifth write picks the register with bits 13 and 14 */
+    m->regs[(a >> 13) & 3] = m->shift;
+    m->shift = 0;
+    m->shift_count = 0;
+  }
+  mmc1_sync(n);
+}
+
+
+/*
+ * ---------- UxROM (2) ----------
+ */
+
+/* regs[0] switches 16K at $8000, the last bank is fixed at $c000 */
+static void uxrom_sync (nes *n) {
+  map_prg(n, 0x8000, 0x4000, n->mapper.regs[0]);
+  map_prg(n, 0xc000, 0x4000, -1);
+  map_chr(n, 0x0000, 0x2000, 0);
+  map_mirroring(n, n->cart->mirroring);
+}
+
+static void uxrom_write (nes *n, addr a, byte b) {
+  n->mapper.regs[0] = b;
+  uxrom_sync(n);
+}
+
+
+/*
+ * ---------- CNROM (3) ----------
+ */
+
+/* regs[0] switches all 8K of chr */
+static void cnrom_sync (nes *n) {
+  map_prg(n, 0x8000, 0x8000, 0);
+  map_chr(n, 0x0000, 0x2000, n->mapper.regs[0]);
+  map_mirroring(n, n->cart->mirroring);
+}
+
+static void cnrom_write (nes *n, addr a, byte b) {
+  n->mapper.regs[0] = b;
+  cnrom_sync(n);
+}
+
+
+/*
+ * ---------- MMC3 (4) ----------
+ */
+
+/* regs[0-7] are the bank registers R0-R7, picked by the low bits of select.
+ * bit 6 of select swaps the prg windows, bit 7 swaps the chr halves */
+
+static void mmc3_sync (nes *n) {
+  mapper *m = &n->mapper;
+  byte *r = m->regs;
+  addr lo = (m->select & 0x80) ? 0x1000 : 0x0000;
+  addr hi = lo ^ 0x1000;
+
+  if (m->select & 0x40) {
+    map_prg(n, 0x8000, 0x2000, -2);
+    map_prg(n, 0xc000, 0x2000, r[6]);
+  } else {
+    map_prg(n, 0x8000, 0x2000, r[6]);
+    map_prg(n, 0xc000, 0x2000, -2);
+  }
+  map_prg(n, 0xa000, 0x2000, r[7]);
+  map_prg(n, 0xe000, 0x2000, -1);
+
+  /* two 2K banks and four 1K banks */
+  map_chr(n, lo + 0x0000, 0x0800, r[0] >> 1);
+  map_chr(n, lo + 0x0800, 0x0800, r[1] >> 1);
+  map_chr(n, hi + 0x0000, 0x0400, r[2]);
+  map_chr(n, hi + 0x0400, 0x0400, r[3]);
+  map_chr(n, hi + 0x0800, 0x0400, r[4]);
+  map_chr(n, hi + 0x0c00, 0x0400, r[5]);
+
+  map_mirroring(n, m->mirroring);
+}
+
+/* registers come in even/odd pairs in each 8K of $8000-$ffff */
+static void mmc3_write (nes *n, addr a, byte b) {
+  mapper *m = &n->mapper;
+  switch (a & 0xe001) {
+  case 0x8000:
+    m->select = b;
+    break;
+  case 0x8001:
+    m->regs[m->select & 7] = b;
+    break;
+  case 0xa000:
+    m->mirroring = (b & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+    break;
+  case 0xa001:
+    /* prg ram protect, which we don't bother with */
+    return;
+  case 0xc000:
+    m->irq_latch = b;
+    return;
+  case 0xc001:
+    /* reload on the next scanline */
+    m->irq_counter = 0;
+    m->irq_reload = 1;
+    return;
+  case 0xe000:
+    /* disable and acknowledge */
+    m->irq_enabled = 0;
+    n->c->irq &= ~IRQ_MAPPER;
+    return;
+  case 0xe001:
+    m->irq_enabled = 1;
+    return;
+  }
+  mmc3_sync(n);
+}
+
+/* the real thing counts rises of ppu address line 12, which happen once
+ * a line when the sprite fetches come from $1000 */
+static void mmc3_scanline (nes *n) {
+  mapper *m = &n->mapper;
+  if (m->irq_counter == 0 || m->irq_reload) {
+    m->irq_counter = m->irq_latch;
+    m->irq_reload = 0;
+  } else {
+    m->irq_counter--;
+  }
+  if (m->irq_counter == 0 && m->irq_enabled)
+    n->c->irq |= IRQ_MAPPER;
+}
+
+
+/*
+ * ---------- user functions ----------
+ */
+
+/* bank switches can change the pattern tables partway through a line, and
+ * the ppu has to be caught up before the irq counter is touched */
+static void mapper_write (nes *n, addr a, byte b) {
+  ppu_line_split(n);
+  n->mapper.write(n, a, b);
+}
+
+/* set up the mapper the cartridge asks for, returns -1 if we don't have it */
+int mapper_init (nes *n) {
+  mapper *m = &n->mapper;
+
+  memset(m, 0, sizeof(mapper));
+  m->number = n->cart->mapper;
+  m->mirroring = n->cart->mirroring;
+
+  switch (m->number) {
+  case 0:
+    m->sync = &nrom_sync;
+    break;
+  case 1:
+    m->sync = &mmc1_sync;
+    m->write = &mmc1_write;
+    /* starts with the last bank fixed at $c000 */
+    m->regs[0] = 0x0c;
+    break;
+  case 2:
+    m->sync = &uxrom_sync;
+    m->write = &uxrom_write;
+    break;
+  case 3:
+    m->sync = &cnrom_sync;
+    m->write = &cnrom_write;
+    break;
+  case 4:
+    m->sync = &mmc3_sync;
+    m->write = &mmc3_write;
+    m->scanline = &mmc3_scanline;
+    break;
+  default:
+    fprintf(stderr, "Mapper %d is not supported.\n", m->number);
+    return -1;
+  }
+
+  /* the registers sit under the rom, so reads go to the rom and writes
+   * go to the mapper */
+  mem_map_io(n->c->mem, 0x8000, 0xffff, NULL, m->write ? &mapper_write : NULL);
+  m->sync(n);
+  return 0;
+}
@@ -6,60 +6,52 @@
 
 #include "nes.h"
 
+/* the whole 64K address space starts out as mirrors of size bytes of ram */
 void mem_init (memory *mem, int size, nes *n) {
-  int a; //need a to be int so it will go over 0xffff
   mem->ram = calloc(sizeof(byte), size); /* cleared to 0 */
-  mem->mirrors = malloc(sizeof(addr) * size);
-  mem->write_cbs = calloc(sizeof(void*) , size);
-  mem->read_cbs = calloc(sizeof(void*) , size);
-  
-  for (a = 0; a < size; a++)
-    mem->mirrors[a] = a;
-
+  memset(mem->read_cbs, 0, sizeof(mem->read_cbs));
+  memset(mem->write_cbs, 0, sizeof(mem->write_cbs));
+  mem->changes = 0;
+  mem_map(mem, 0x0000, 0xffff, mem->ram, size);
   mem->n = n;
 }
 
-void mem_write (memory *mem, addr a, byte b) {
-  addr a1 = mem->mirrors[a];
-  mem->ram[a1] = b;
-  if (mem->write_cbs[a1])
-    (mem->write_cbs[a1])(mem->n, b);
+void mem_destroy (memory *mem) {
+  free(mem->ram);
 }
 
-byte mem_read (memory *mem, addr a) {
-  addr a1 = mem->mirrors[a];
-  if (mem->read_cbs[a1]) 
-    return (mem->read_cbs[a1])(mem->n);
-  return mem->ram[a1];
+/* point the pages from start to end at base, repeating every size bytes.
+ * start, end + 1 and size all need to be multiples of the page size */
+void mem_map (memory *mem, addr start, addr end, byte *base, int size) {
+  int p;
+  mem_map_rom(mem, start, end, base, size);
+  for (p = start >> MEM_PAGE_BITS; p <= end >> MEM_PAGE_BITS; p++)
+    mem->write_pages[p] = mem->read_pages[p];
 }
 
-void mem_destroy (memory *mem) {
-  free(mem->ram);
-  free(mem->write_cbs);
+/* same as mem_map, but only for reading. writes go to the page callbacks */
+void mem_map_rom (memory *mem, addr start, addr end, byte *base, int size) {
+  int p;
+  for (p = start >> MEM_PAGE_BITS; p <= end >> MEM_PAGE_BITS; p++) {
+    mem->read_pages[p] = base + ((p << MEM_PAGE_BITS) - start) % size;
+    mem->write_pages[p] = NULL;
+  }
+  mem->changes++;
 }
 
-void mem_mirror (memory *mem, addr start, addr end, int size) {
-  addr a;
-  for (a = start; a <= end; a++) {
-    mem->mirrors[a] = start + a % size;
+/* send every access from start to end through callbacks */
+void mem_map_io (memory *mem, addr start, addr end, read_cb r, write_cb w) {
+  int p;
+  for (p = start >> MEM_PAGE_BITS; p <= end >> MEM_PAGE_BITS; p++) {
+    mem->read_pages[p] = NULL;
+    mem->write_pages[p] = NULL;
+    mem->read_cbs[p] = r;
+    mem->write_cbs[p] = w;
   }
+  mem->changes++;
 }
-    
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
 
+/* make start to end a mirror of the size bytes of ram at start */
+void mem_mirror (memory *mem, addr start, addr end, int size) {
+  mem_map(mem, start, end, &mem->ram[start], size);
+}
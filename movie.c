@@ -0,0 +1,169 @@
+/*
+ * movie.c
+ * by Max Willsey
+ * records what's pressed on the controllers every frame, and plays it back
+ */
+
+#include "nes.h"
+
+#define MOVIE_VERSION 1
+
+/* a movie is "NESM", the version, a hash of the rom, the ppu frame it
+ * starts on, then a byte for each controller for every frame after that.
+ * Frames are counted by the ppu, so loading a save state or rewinding
+ * while recording picks the movie up from the same place */
+
+/* FNV-1a over the whole rom file */
+static uint32_t rom_hash (cart *cart) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < cart->size; i++)
+    h = (h ^ cart->data[i]) * 16777619u;
+  return h;
+}
+
+/* start recording from the frame the machine is on, the movie is written
+ * out to file when it's closed */
+int movie_record (movie *m, nes *n, char *file) {
+  FILE *out = fopen(file, "wb");
+  if (!out) {
+    fprintf(stderr, "Could not open movie file '%s'.\n", file);
+    return -1;
+  }
+  fclose(out);
+  m->capacity = 60 * 60;
+  m->data = malloc(m->capacity * 2);
+  m->length = 0;
+  m->start = n->p->frames;
+  m->recording = 1;
+  m->file = file;
+  m->hash = rom_hash(n->cart);
+  return 0;
+}
+
+/* load a movie to play back. A machine that's already past where it starts,
+ * like from a save state, picks it up at its own frame. returns 0 on
+ * success or -1 */
+int movie_play (movie *m, nes *n, char *file) {
+  FILE *in = fopen(file, "rb");
+  byte head[16];
+  uint32_t version, start;
+  long size;
+
+  if (!in) {
+    fprintf(stderr, "Could not open movie file '%s'.\n", file);
+    return -1;
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in) - 16;
+  rewind(in);
+  if (size < 0 || fread(head, 1, 16, in) != 16 || memcmp(head, "NESM", 4)) {
+    fprintf(stderr, "'%s' is not a movie.\n", file);
+    fclose(in);
+    return -1;
+  }
+  memcpy(&version, head + 4, 4);
+  memcpy(&m->hash, head + 8, 4);
+  memcpy(&start, head + 12, 4);
+  if (version != MOVIE_VERSION) {
+    fprintf(stderr, "Movie is version %u, we need %d.\n", version, MOVIE_VERSION);
+    fclose(in);
+    return -1;
+  }
+  if (m->hash != rom_hash(n->cart)) {
+    fprintf(stderr, "Movie was recorded with a different rom.\n");
+    fclose(in);
+    return -1;
+  }
+  if (n->p->frames > start + size / 2) {
+    fprintf(stderr, "Movie ends at frame %llu, we're already at %llu.\n",
+            (unsigned long long) start + size / 2,
+            (unsigned long long) n->p->frames);
+    fclose(in);
+    return -1;
+  }
+
+  m->length = m->capacity = size / 2;
+  m->data = malloc(size > 0 ? size : 1);
+  m->start = start;
+  m->recording = 0;
+  m->file = NULL;
+  if (fread(m->data, 2, m->length, in) != (size_t) m->length) {
+    fprintf(stderr, "Could not read movie file '%s'.\n", file);
+    fclose(in);
+    free(m->data);
+    return -1;
+  }
+  fclose(in);
+  return 0;
+}
+
+/* call before running each frame. Recording, it keeps what's in n->pads.
+ * Playing back, it sets n->pads, and returns -1 once the movie is over */
+int movie_frame (movie *m, nes *n) {
+  long i = n->p->frames - m->start;
+
+  /* before the movie starts there's nothing to record, and nothing's
+   * pressed */
+  if (n->p->frames < m->start) {
+    if (!m->recording)
+      n->pads[0] = n->pads[1] = 0;
+    return 0;
+  }
+
+  if (m->recording) {
+    while (i >= m->capacity) {
+      m->capacity *= 2;
+      m->data = realloc(m->data, m->capacity * 2);
+    }
+    /* anything after this frame was rewound away */
+    m->data[2 * i] = n->pads[0];
+    m->data[2 * i + 1] = n->pads[1];
+    m->length = i + 1;
+    return 0;
+  }
+
+  if (i >= m->length)
+    return -1;
+  n->pads[0] = m->data[2 * i];
+  n->pads[1] = m->data[2 * i + 1];
+  return 0;
+}
+
+/* set n->pads to what the movie has for this frame without recording over
+ * it, for running a frame again, like after rewinding. returns -1 if the
+ * movie doesn't have the frame */
+int movie_replay (movie *m, nes *n) {
+  long i = n->p->frames - m->start;
+
+  if (n->p->frames < m->start || i >= m->length)
+    return -1;
+  n->pads[0] = m->data[2 * i];
+  n->pads[1] = m->data[2 * i + 1];
+  return 0;
+}
+
+/* finish with a movie, writing it out if it was recorded. returns -1 if
+ * that fails */
+int movie_close (movie *m) {
+  uint32_t version = MOVIE_VERSION, start = m->start;
+  FILE *out;
+  int ok = 1;
+
+  if (m->recording) {
+    out = fopen(m->file, "wb");
+    if (out) {
+      ok = fwrite("NESM", 1, 4, out) == 4 &&
+        fwrite(&version, 4, 1, out) == 1 &&
+        fwrite(&m->hash, 4, 1, out) == 1 &&
+        fwrite(&start, 4, 1, out) == 1 &&
+        fwrite(m->data, 2, m->length, out) == (size_t) m->length;
+      fclose(out);
+    }
+    if (!out || !ok)
+      fprintf(stderr, "Could not write movie file '%s'.\n", m->file);
+    ok = out && ok;
+  }
+  free(m->data);
+  return ok ? 0 : -1;
+}
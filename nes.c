@@ -6,35 +6,192 @@
 
 #include "nes.h"
 
+
+/* each controller is a shift register that's loaded with the buttons
+ * while the strobe is high, then read out a bit at a time. once all 8
+ * are out, official pads give 1s */
+static byte pad_read (nes *n, int i) {
+  byte b;
+  if (n->strobe)
+    n->pad_shift[i] = n->pads[i];
+  b = n->pad_shift[i] & 1;
+  n->pad_shift[i] = (n->pad_shift[i] >> 1) | 0x80;
+  /* the top bits are whatever was last on the bus, usually $40 */
+  return b | 0x40;
+}
+
+static void pad_strobe (nes *n, byte b) {
+  n->strobe = b & 1;
+  if (n->strobe) {
+    n->pad_shift[0] = n->pads[0];
+    n->pad_shift[1] = n->pads[1];
+  }
+}
+
+/* $4000-$40ff holds the apu and the rest of the i/o registers */
+static byte nes_read_io (nes *n, addr a) {
+  switch (a) {
+  case 0x4015:
+    return apu_read(n, a);
+  case 0x4016:
+  case 0x4017:
+    return pad_read(n, a & 1);
+  }
+  return 0;
+}
+
+static void nes_write_io (nes *n, addr a, byte b) {
+  switch (a) {
+  case 0x4014:
+    /* it starts once the write's done, see cpu_step */
+    n->c->dma = b;
+    break;
+  case 0x4016:
+    pad_strobe(n, b);
+    break;
+  default:
+    if (a <= 0x4017)
+      apu_write(n, a, b);
+    break;
+  }
+}
+
 void nes_init (nes *n) {
   n->c = malloc(sizeof(cpu));
   n->p = malloc(sizeof(ppu));
+  n->trace = NULL;
+  n->cart = NULL;
+  n->prg_ram = NULL;
+  n->prg_ram_size = 0;
+  n->chr_ram = NULL;
+  n->chr_ram_size = 0;
+  memset(n->pads, 0, sizeof(n->pads));
+  memset(n->pad_shift, 0, sizeof(n->pad_shift));
+  n->strobe = 0;
+  n->herd = NULL;
+  n->lane = 0;
+  memset(&n->prof, 0, sizeof(n->prof));
   cpu_init(n);
   ppu_init(n);
-  n->lower_bank = &n->c->mem->ram[0x8000];
-  n->upper_bank = &n->c->mem->ram[0xc000];
-  n->chr_rom = &n->p->mem->ram[0x0000];
+  apu_init(n);
+  mem_map_io(n->c->mem, 0x4000, 0x40ff, &nes_read_io, &nes_write_io);
+}
+
+/* plug a cartridge in, returns 0 on success or -1 if we can't run it */
+int nes_insert (nes *n, cart *cart) {
+  n->cart = cart;
+
+  /* prg ram at $6000, as much as the header says or 8K if it doesn't,
+   * mirrored up to $7fff. The trainer goes at $7000 if there is one, so
+   * then there has to be ram there. The memory maps whole pages */
+  n->prg_ram_size = cart->prg_ram_size ? cart->prg_ram_size : 0x2000;
+  if (cart->trainer && n->prg_ram_size < 0x2000)
+    n->prg_ram_size = 0x2000;
+  n->prg_ram_size = (n->prg_ram_size + MEM_PAGE_SIZE - 1) &
+    ~(size_t)(MEM_PAGE_SIZE - 1);
+  n->prg_ram = calloc(sizeof(byte), n->prg_ram_size);
+  if (cart->trainer)
+    memcpy(n->prg_ram + 0x1000, cart->trainer, 512);
+  mem_map(n->c->mem, 0x6000, 0x7fff, n->prg_ram,
+          n->prg_ram_size < 0x2000 ? n->prg_ram_size : 0x2000);
+
+  /* boards without chr rom have at least 8K of chr ram */
+  if (!cart->chr) {
+    n->chr_ram_size = cart->chr_ram_size > 0x2000 ? cart->chr_ram_size : 0x2000;
+    n->chr_ram = calloc(sizeof(byte), n->chr_ram_size);
+  }
+
+  /* the mapper maps in the prg and chr banks */
+  return mapper_init(n);
 }
 
 void nes_step (nes *n) {  
-  int i;
   cpu_step(n);
-  for (i=0; i<7; i++) {
-    /* give 3 cycles to ppu */
-    sem_post(n->p->clock);
-    sem_post(n->p->clock);
-    sem_post(n->p->clock);
-  }
+  nes_sync(n);
+}
+
+/* catch the ppu and apu up if the cpu has run past where they said to.
+ * they only need to when they could interrupt the cpu */
+void nes_sync (nes *n) {
+  if (n->c->cycles * 3 >= n->p->deadline)
+    ppu_catch_up(n);
+  if (n->c->cycles >= n->a->deadline)
+    apu_catch_up(n);
+}
+
+/* run until the ppu finishes the frame it's on */
+void nes_frame (nes *n) {
+  uint64_t frame = n->p->frames;
+  while (n->p->frames == frame)
+    nes_step(n);
+  apu_end_frame(n);
 }
-  
 
 byte *nes_frame_buffer(nes *n) {
   return (byte*) n->p->frame_buffer;
 }
 
+/* xxHash64 (with a seed of 0) */
+#define XXH_P1 11400714785074694791ull
+#define XXH_P2 14029467366897019727ull
+#define XXH_P3 1609587929392839161ull
+#define XXH_P4 9650029242287828579ull
+
+static uint64_t rotl (uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/* 8 bytes, little endian whatever the machine is */
+static uint64_t read64 (byte *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+    (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint64_t xxh_round (uint64_t acc, uint64_t input) {
+  return rotl(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge (uint64_t acc, uint64_t v) {
+  return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+/* hash of the last frame, for checking runs against each other. It's
+ * quick enough to do every frame: the frame goes through 8 bytes at a
+ * time in 4 lanes that don't wait on each other. A frame is a whole
+ * number of 32 byte stripes, so there's no tail to hash */
+uint64_t nes_frame_hash (nes *n) {
+  byte *f = nes_frame_buffer(n), *end = f + 256 * 240;
+  uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1, h;
+
+  for (; f < end; f += 32) {
+    v1 = xxh_round(v1, read64(f));
+    v2 = xxh_round(v2, read64(f + 8));
+    v3 = xxh_round(v3, read64(f + 16));
+    v4 = xxh_round(v4, read64(f + 24));
+  }
+  h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+  h = xxh_merge(h, v1);
+  h = xxh_merge(h, v2);
+  h = xxh_merge(h, v3);
+  h = xxh_merge(h, v4);
+  h += 256 * 240;
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
 void nes_destroy (nes *n) {
   cpu_destroy(n);
   ppu_destroy(n);
+  apu_destroy(n);
   free(n->c);
   free(n->p);
+  free(n->a);
+  free(n->prg_ram);
+  free(n->chr_ram);
 }
@@ -7,10 +7,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
 
-#include <pthread.h>
-#include <semaphore.h>
 
 typedef uint8_t  byte;
 typedef uint16_t addr;
@@ -18,27 +19,197 @@ typedef bool     bit;
 
 struct cpu_s;
 struct ppu_s;
+struct apu_s;
 
+/* one instruction as recorded by the trace, before it executes */
 typedef struct {
+  uint64_t cycle;
+  addr PC;
+  byte op, A, X, Y, P, SP;
+} trace_entry;
+
+/* ring buffer of the most recent instructions */
+typedef struct {
+  trace_entry *entries;
+  uint64_t size;                /* a power of 2 */
+  uint64_t count;               /* entries ever recorded */
+  uint64_t flushed;             /* entries already written to out */
+  FILE *out;                    /* if set, entries are written here as the
+                                 * ring fills up */
+  FILE *expect;                 /* if set, entries are checked against this
+                                 * log in nestest.log's format as they're
+                                 * recorded */
+  uint64_t lines;               /* lines of expect to check, 0 for all */
+  uint64_t matched;             /* lines of expect that matched so far */
+  int scanline;                 /* the log's first scanline, less ours */
+  bit done, failed;             /* ran out of lines, or one didn't match */
+} trace;
+
+/* how the 4 nametables are laid out in the 2K of vram */
+enum mirroring {
+  MIRROR_HORIZONTAL,
+  MIRROR_VERTICAL,
+  MIRROR_SINGLE_LOWER,
+  MIRROR_SINGLE_UPPER,
+  MIRROR_FOUR_SCREEN            /* the cartridge supplies another 2K */
+};
+
+/* a ROM file, the banks point right into the mapped file */
+typedef struct {
+  byte *data;
+  size_t size;
+  byte *prg;
+  size_t prg_size;
+  byte *chr;                    /* NULL when the board has chr ram */
+  size_t chr_size;
+  byte *trainer;                /* 512 bytes for $7000, or NULL */
+  int mapper, submapper;
+  int mirroring;
+  bit battery;                  /* prg ram is saved */
+  bit nes2;                     /* NES 2.0 header */
+  size_t prg_ram_size;
+  size_t chr_ram_size;
+} cart;
+
+struct nes_s;
+
+/* bank switching hardware on the cartridge. what the registers mean is up
+ * to each mapper, see mapper.c */
+typedef struct {
+  int number;
+  /* point the memory maps at the banks the registers select */
+  void (*sync) (struct nes_s *n);
+  /* cpu writes to $8000-$ffff */
+  void (*write) (struct nes_s *n, addr a, byte b);
+  /* called once per rendered scanline, for irq counters */
+  void (*scanline) (struct nes_s *n);
+  byte regs[8];
+  byte select;
+  byte shift, shift_count;
+  int mirroring;
+  /* scanline irq */
+  byte irq_latch, irq_counter;
+  bit irq_enabled, irq_reload;
+} mapper;
+
+/* time spent in each part of the machine, for the benchmarks. Each part's
+ * time leaves out the parts it calls, so they add up to the whole run.
+ * The parts are timed where they're entered, which is once a frame for the
+ * cpu, since timing every instruction costs about as much as running it */
+enum {
+  PROF_OTHER,
+  PROF_CPU,                     /* running frames, less the parts below */
+  PROF_PPU,                     /* catching the ppu up */
+  PROF_APU,                     /* catching the apu up and making sound */
+  PROF_IO,                      /* i/o reads and writes, not counting the
+                                 * ppu or apu they catch up */
+  PROF_PRESENT,                 /* turning frames into pixels */
+  PROF_PARTS
+};
+
+typedef struct {
+  bit on;
+  uint64_t ticks[PROF_PARTS];
+  uint64_t calls[PROF_PARTS];
+  int stack[16], depth;         /* the parts we're in */
+  uint64_t last;                /* when the innermost one was entered */
+} profile;
+
+typedef struct nes_s {
   struct cpu_s *c;
   struct ppu_s *p;
+  struct apu_s *a;
+  trace *trace;                 /* NULL when not tracing */
   /* special spaces in memory */
-  byte *lower_bank;
-  byte *upper_bank;
-  byte *chr_rom;
+  cart *cart;
+  mapper mapper;
+  byte *prg_ram;
+  size_t prg_ram_size;
+  byte *chr_ram;
+  size_t chr_ram_size;
+  /* controllers, see below */
+  byte pads[2];                 /* buttons held, set before each frame */
+  byte pad_shift[2];            /* what's left to read out */
+  bit strobe;                   /* reloading the shift registers */
+  /* running in lockstep with other machines, see lockstep.c */
+  struct herd_s *herd;          /* NULL when running alone */
+  int lane;
+  profile prof;                 /* where the time goes, when it's on */
 } nes; 
 
+/* controller buttons, in the order the shift register reads them out */
+#define PAD_A      0x01
+#define PAD_B      0x02
+#define PAD_SELECT 0x04
+#define PAD_START  0x08
+#define PAD_UP     0x10
+#define PAD_DOWN   0x20
+#define PAD_LEFT   0x40
+#define PAD_RIGHT  0x80
+
+/* a recording of the controllers, see movie.c */
+typedef struct {
+  byte *data;                   /* 2 bytes a frame */
+  long length, capacity;        /* in frames */
+  uint64_t start;               /* ppu frame the movie starts at */
+  bit recording;
+  char *file;                   /* written out when a recording closes */
+  uint32_t hash;                /* of the rom it goes with */
+} movie;
+
+/* a frame of rewind history, see rewind.c */
+typedef struct {
+  size_t offset, size;          /* where its encoding is in the arena */
+  bit key;                      /* a keyframe, the frames after it need it */
+} rewind_entry;
+
+typedef struct {
+  byte *arena;
+  size_t budget;                /* bytes in the arena */
+  size_t head;                  /* where the next frame goes */
+  rewind_entry *entries;        /* ring of frames, oldest at start */
+  int capacity, start, count;
+  int interval, since_key;      /* frames between keyframes */
+  size_t state_size;
+  byte *cur, *key, *scratch;
+} rewind_buf;
+
+/* address spaces are mapped in pages of 256 bytes */
+#define MEM_PAGE_BITS 8
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_BITS)
+#define MEM_PAGES     (0x10000 >> MEM_PAGE_BITS)
+
+typedef byte (*read_cb) (nes*, addr);
+typedef void (*write_cb) (nes*, addr, byte);
+
+/* each page is read or written straight through a pointer to its backing
+ * bytes, or when that pointer is NULL, through the page's callback */
 typedef struct {
   nes *n;
-  byte *ram;
-  addr *mirrors;
-  /* eventually I'd like to clean up the callback structure */
-  void (**write_cbs)(nes*, byte);
-  byte (**read_cbs) (nes*);
+  byte *ram;                    /* backing store owned by this memory */
+  byte *read_pages[MEM_PAGES];
+  byte *write_pages[MEM_PAGES];
+  read_cb read_cbs[MEM_PAGES];
+  write_cb write_cbs[MEM_PAGES];
+  unsigned changes;             /* counts changes to the map */
 } memory;
 
+/* an instruction in the decode cache, see cpu.c */
+typedef struct {
+  byte op;
+  byte size;                    /* bytes it takes, 0 until it's decoded */
+  addr arg;                     /* the bytes after op */
+} decoded_op;
+
+/* the decoding of a page of memory. It's found by where the page's bytes
+ * are rather than its address, so it follows the page around as banks are
+ * switched in and out */
+typedef struct {
+  byte *base;
+  decoded_op ops[MEM_PAGE_SIZE];
+} decoded_page;
+
 struct cpu_s { 
-  sem_t clock;
   memory *mem;
   /* registers */
   byte A;              /* accumulator */
@@ -46,74 +217,365 @@ struct cpu_s {
   byte SP;             /* stack pointer */
   addr PC;             /* program counter, the only 16 bit register */
   byte P;              /* processor status register */
+  bit nmi;             /* an NMI is waiting */
+  byte irq;            /* irq lines being held low, see below */
+  /* timing */
+  uint64_t cycles;     /* total cycles executed */
+  byte extra;          /* extra cycles taken by branches this instruction */
+  bit crossed;         /* last indexed address crossed a page */
+  addr arg;            /* operand of this instruction */
+  byte op;             /* and its opcode */
+  bit busy;            /* in the middle of it, see cpu_clock */
+  int dma;             /* page an OAM DMA was started from, -1 for none */
+  /* decode cache */
+  decoded_page *code[MEM_PAGES];  /* each page's decoding, NULL to find it */
+  decoded_page **decoded;         /* every page decoded, hashed by base */
+  int decoded_size, decoded_count;
+  unsigned code_changes;          /* mem->changes that code is up to date with */
+  decoded_page *guarded[MEM_PAGES];/* ram pages with code, which we watch */
+  write_cb guarded_cbs[MEM_PAGES];/* and what their writes went to before */
 };
 
+/* things that can ask for an irq */
+#define IRQ_MAPPER 0x01
+#define IRQ_FRAME  0x02          /* apu frame counter */
+#define IRQ_DMC    0x04          /* end of a dmc sample */
+
 struct ppu_s {
-  sem_t clock;
-  sem_t render_clock, bg_clock, oam_clock;
-  
   memory *mem;
 
   int cycle;                    /* 341 per scanline */
   int scanline;                 /* 262 per frame */
   bit even_frame;
+  uint64_t frames;              /* frames finished so far */
+  uint64_t clock;               /* dots run so far */
+  uint64_t deadline;            /* has to catch up by this dot, see ppu.c */
 
   bit first_write;
-  bit rendering;
-
-
-  /*** background stuff ***/
-
-  /* latches */
-  byte nt_entry, at_entry;
-  byte at_latch;
-  byte pt_latch_lo, pt_latch_hi;
-
-  /* shift register */
-  addr at_shift;
-  addr pt_shift_lo, pt_shift_hi;
 
   /*** sprite stuff ***/
   byte oam1[64][4];
-  byte oam2[8][4];
-  byte spr_shift[8][2];
-  byte spr_latch[8];
-  byte spr_count[8];
-  
+  byte oam_order[64];           /* oam1 sorted by y, see ppu.c */
+  bit oam_dirty;                /* oam_order needs rebuilding */
+  int oam_next;                 /* first in oam_order that may be on a line */
+  byte oam2[8][4];              /* the sprites on this line */
+  int spr_count;
+  byte spr_line[256];           /* this line's sprite pixels, see below */
 
   /* registers */
   byte ctrl;
   byte mask;
   byte status;
   byte oam_addr;
-  byte oam_data;
-  byte scrollx, scrolly;
-  addr addr;
+  addr addr;                    /* vram address, also the scroll position */
+  addr tmp;                     /* the address being written */
+  byte fine_x;
+  byte data_buffer;             /* for $2007 reads */
+  byte palette[32];
+  /* background renderer, see ppu.c */
+  int line_x;                   /* scroll position of the line's first pixel */
+  int line_drawn;               /* pixels of this line drawn so far */
+  bit dot_mode;                 /* finish the line a dot at a time */
+  byte chr_cache[512][64];      /* decoded pattern tables, see ppu.c */
+  byte chr_dirty[512];
   /* for output */
   byte frame_buffer[240][256];
 };
 
+/* one of the apu's tone channels. pulse, triangle and noise each use only
+ * some of this, see apu.c */
+typedef struct {
+  bit enabled;
+  int timer, period;            /* cpu cycles to the next step, and between */
+  int raw_period;               /* the 11 bit period the registers set */
+  int step;                     /* place in the waveform */
+  byte length;                  /* length counter, silent at 0 */
+  bit halt;                     /* length halt, also envelope loop */
+  /* envelope */
+  bit constant, env_start;
+  byte volume, env_divider, env_decay;
+  /* pulse */
+  byte duty;
+  bit sweep_enabled, sweep_negate, sweep_reload;
+  byte sweep_period, sweep_shift, sweep_divider;
+  /* triangle */
+  byte linear, linear_reload;
+  bit linear_start;
+  /* noise */
+  uint16_t lfsr;
+  bit mode;
+} apu_channel;
+
+/* delta modulation channel, plays 1 bit samples out of cpu memory */
+typedef struct {
+  bit irq_enabled, loop;
+  int timer, period;
+  addr start, address;
+  uint16_t length, remaining;   /* bytes of the sample */
+  byte buffer;
+  bit buffer_full;
+  byte shift, bits;
+  bit silence;
+  byte level;                   /* 7 bit output */
+} apu_dmc;
+
+struct apu_s {
+  apu_channel pulse[2], triangle, noise;
+  apu_dmc dmc;
+  /* frame counter */
+  bit five_step, irq_inhibit, frame_irq, dmc_irq;
+  int frame_step, frame_timer;
+  uint64_t clock;               /* cpu cycles run so far */
+  uint64_t deadline;            /* has to catch up by this cycle */
+
+  /*** output, none of this is saved ***/
+  int rate;                     /* samples a second, 0 for no sound */
+  double ratio;                 /* samples per cpu cycle */
+  float level;                  /* the mixer's output right now */
+  uint64_t buf_clock;           /* the cycle buf starts at */
+  double buf_offset;            /* and how far into its first sample */
+  float *buf;                   /* band limited steps, see apu.c */
+  float sum, hp_in, hp_out;     /* integrator and dc filter */
+  /* finished samples go through a ring, written by the emulator and read
+   * by the sound card. head and tail only ever count up */
+  int16_t *ring;
+  unsigned ring_size;           /* a power of 2 */
+  atomic_uint head, tail;
+  unsigned target;              /* samples to keep queued */
+  int16_t last;                 /* repeated when the ring runs dry */
+};
+
+/* spr_line holds the palette index (low 4 bits) of each sprite pixel */
+#define SPR_BEHIND 0x20         /* goes behind the background */
+#define SPR_ZERO   0x40         /* from sprite 0 */
+
 typedef struct cpu_s cpu;
 typedef struct ppu_s ppu;
+typedef struct apu_s apu;
 
 void nes_init(nes *n);
+int  nes_insert(nes *n, cart *cart);
 void nes_step(nes *n);
+void nes_sync(nes *n);
+void nes_frame(nes *n);
 byte* nes_frame_buffer(nes *n);
+uint64_t nes_frame_hash (nes *n);
 void nes_destroy(nes *n);
-/* new structure */
-void nes_run(nes *n);
 
 void cpu_init (nes *n);
 void cpu_load (nes *n);
-void cpu_step (nes *n);
+int  cpu_step (nes *n);
+uint64_t cpu_clock (nes *n);
+void cpu_forget_code (nes *n);
 void cpu_destroy (nes *n);
 
 void ppu_init (nes *n);
-void ppu_step (nes *n);
+void ppu_catch_up (nes *n);
+void ppu_line_split (nes *n);
+void ppu_chr_dirty (nes *n, addr start, addr end);
+int  ppu_oam_dma (nes *n, byte page);
+void ppu_mirror (nes *n, int mirroring);
 void ppu_destroy (nes *n);
 
+void apu_init (nes *n);
+void apu_catch_up (nes *n);
+byte apu_read (nes *n, addr a);
+void apu_write (nes *n, addr a, byte b);
+void apu_end_frame (nes *n);
+void apu_output (nes *n, int rate, unsigned latency);
+unsigned apu_queued (apu *a);
+void apu_samples (apu *a, int16_t *out, int count);
+void apu_destroy (nes *n);
+
+int  cart_load (cart *cart, char *file);
+void cart_unload (cart *cart);
+
+int  mapper_init (nes *n);
+
+size_t nes_state_size (nes *n);
+size_t nes_save_state_buf (nes *n, byte *buf, size_t size);
+int    nes_load_state_buf (nes *n, byte *buf, size_t size);
+int    nes_save_state (nes *n, char *file);
+int    nes_load_state (nes *n, char *file);
+
+int    rewind_init (rewind_buf *r, nes *n, int frames, size_t budget, int interval);
+void   rewind_push (rewind_buf *r, nes *n);
+int    rewind_pop (rewind_buf *r, nes *n);
+size_t rewind_used (rewind_buf *r);
+void   rewind_destroy (rewind_buf *r);
+
+int  movie_record (movie *m, nes *n, char *file);
+int  movie_play (movie *m, nes *n, char *file);
+int  movie_frame (movie *m, nes *n);
+int  movie_replay (movie *m, nes *n);
+int  movie_close (movie *m);
+
+/* many machines running the same rom side by side, see lockstep.c. Their
+ * cpu registers and work ram are kept a lane per machine, so machines at
+ * the same place in the code can run the instruction together */
+/* machines in a herd at the same place in the same code, running
+ * instructions together. See lockstep.c */
+typedef struct {
+  addr pc;
+  int banks;                    /* the set of prg banks they have mapped */
+  uint64_t ran;                 /* cycles run since they were added up */
+  int64_t limit;                /* ran when one reaches its deadline */
+  bit waiting;                  /* an interrupt, for one of them at least */
+  int first, last, size;        /* its lanes */
+  byte *mask;                   /* 0xff in each of its lanes */
+} herd_group;
+
+/* a place machines are at in a step */
+typedef struct {
+  unsigned stamp;               /* in use if it's the step's */
+  addr pc;
+  int banks;
+  int group;                    /* the group there, or -1 */
+  int head, count;              /* machines on their own there, by next */
+} herd_slot;
+
+typedef struct herd_s {
+  int count;                    /* machines */
+  int stride;                   /* lanes, count rounded up to whole vectors */
+  nes *n;                       /* the rest of each machine */
+  /* registers of machines in groups. One on its own has them in its cpu */
+  byte *A, *X, *Y, *SP, *P;
+  uint64_t *cycles;             /* less what its group's ran */
+  uint64_t *deadline;           /* cycle the ppu or apu needs a look in by */
+  byte *ram;                    /* byte a of lane k is ram[a * stride + k] */
+  byte *interrupt;              /* 2 for an nmi, 1 for an irq waiting */
+  int *banks;                   /* which of bank_sets lane k has mapped */
+  unsigned *changes;            /* of the map when banks was worked out */
+  byte ***bank_sets;            /* every set of prg pages seen, by hash */
+  int bank_count;
+  /* scratch for each frame and step */
+  byte *running, *grouped, *taken, *val;
+  addr *where;
+  uint64_t *frame;
+  int left;                     /* machines still in the frame */
+  herd_group *groups;           /* room for twice count */
+  byte *masks;                  /* theirs, a stride each */
+  int group_count;
+  int *loose, loose_count;      /* machines on their own */
+  herd_slot *slots;             /* hashed by place, slot_mask + 1 of them */
+  int slot_mask;
+  unsigned step;
+  int *next;
+  /* instructions run by the lanes together and alone */
+  uint64_t together, alone;
+} herd;
+
+int  herd_init (herd *h, int count, cart *cart);
+void herd_frame (herd *h);
+void herd_export (herd *h, int lane);
+void herd_import (herd *h, int lane);
+void herd_destroy (herd *h);
+
+void trace_init (trace *t, int size, FILE *out);
+void trace_expect (trace *t, FILE *log, uint64_t lines);
+void trace_check (trace *t, trace_entry *e);
+void trace_flush (trace *t);
+void trace_dump (trace *t, FILE *f);
+void trace_destroy (trace *t);
+
+/* build with -DNES_TRACE to be able to turn on tracing at runtime,
+ * otherwise it compiles away to nothing */
+#ifdef NES_TRACE
+#define TRACE(n, op) if ((n)->trace) trace_record((n)->trace, (n)->c, (op))
+#else
+#define TRACE(n, op)
+#endif
+
+static inline void trace_record (trace *t, cpu *c, byte op) {
+  trace_entry *e;
+  if (t->out && t->count - t->flushed == t->size)
+    trace_flush(t);
+  e = &t->entries[t->count++ & (t->size - 1)];
+  e->cycle = c->cycles;
+  e->PC = c->PC;
+  e->op = op;
+  e->A = c->A;
+  e->X = c->X;
+  e->Y = c->Y;
+  e->P = c->P;
+  e->SP = c->SP;
+  if (t->expect)
+    trace_check(t, e);
+}
+
+
+static inline uint64_t prof_clock (void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+#endif
+}
+
+static inline void prof_enter (nes *n, int part) {
+  profile *p = &n->prof;
+  uint64_t now;
+  if (!p->on)
+    return;
+  now = prof_clock();
+  p->ticks[p->stack[p->depth]] += now - p->last;
+  p->stack[++p->depth] = part;
+  p->calls[part]++;
+  p->last = now;
+}
+
+static inline void prof_leave (nes *n) {
+  profile *p = &n->prof;
+  uint64_t now;
+  if (!p->on)
+    return;
+  now = prof_clock();
+  p->ticks[p->stack[p->depth--]] += now - p->last;
+  p->last = now;
+}
+
+/* build with -DNES_PROFILE to be able to turn on profiling at runtime,
+ * otherwise it compiles away to nothing */
+#ifdef NES_PROFILE
+#define PROF_ENTER(n, part) prof_enter(n, part)
+#define PROF_LEAVE(n) prof_leave(n)
+#else
+#define PROF_ENTER(n, part)
+#define PROF_LEAVE(n)
+#endif
+
 void mem_init (memory *mem, int size, nes *n);
-void mem_write (memory *mem, addr a, byte b);
-byte mem_read (memory *mem, addr a);
 void mem_destroy (memory *mem);
+void mem_map (memory *mem, addr start, addr end, byte *base, int size);
+void mem_map_rom (memory *mem, addr start, addr end, byte *base, int size);
+void mem_map_io (memory *mem, addr start, addr end, read_cb r, write_cb w);
 void mem_mirror (memory *mem, addr start, addr end, int size);
+
+/* reads from unmapped i/o come back as 0, and writes to them (or to rom)
+ * are dropped. Only the callbacks are profiled, timing every plain access
+ * would cost far more than the access */
+static inline byte mem_read (memory *mem, addr a) {
+  byte *page = mem->read_pages[a >> MEM_PAGE_BITS];
+  byte b = 0;
+  if (page)
+    return page[a & (MEM_PAGE_SIZE - 1)];
+  if (mem->read_cbs[a >> MEM_PAGE_BITS]) {
+    PROF_ENTER(mem->n, PROF_IO);
+    b = mem->read_cbs[a >> MEM_PAGE_BITS](mem->n, a);
+    PROF_LEAVE(mem->n);
+  }
+  return b;
+}
+
+static inline void mem_write (memory *mem, addr a, byte b) {
+  byte *page = mem->write_pages[a >> MEM_PAGE_BITS];
+  if (page) {
+    page[a & (MEM_PAGE_SIZE - 1)] = b;
+  } else if (mem->write_cbs[a >> MEM_PAGE_BITS]) {
+    PROF_ENTER(mem->n, PROF_IO);
+    mem->write_cbs[a >> MEM_PAGE_BITS](mem->n, a, b);
+    PROF_LEAVE(mem->n);
+  }
+}
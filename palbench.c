@@ -0,0 +1,62 @@
+/*
+ * palbench.c
+ * by Max Willsey
+ * times the palette conversions against each other
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "palette.h"
+
+static uint8_t frame[240 * 256];
+/* a row pitch a bit wider than the frame, like a real surface might have */
+#define PITCH (256 * 4 + 64)
+static uint8_t want[240 * PITCH], got[240 * PITCH];
+
+static void bench (const char *name, palette_fn fn, palette *pal, int rounds) {
+  struct timespec start, end;
+  double secs;
+  int i;
+
+  if (!fn) {
+    printf("%-7s not available\n", name);
+    return;
+  }
+  memset(got, 0, sizeof(got));
+  fn(pal, got, PITCH, frame);
+  if (memcmp(got, want, sizeof(got))) {
+    printf("%-7s gives the wrong pixels!\n", name);
+    exit(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < rounds; i++)
+    fn(pal, got, PITCH, frame);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%-7s %8.2f us/frame\n", name, secs / rounds * 1e6);
+}
+
+int main (int argc, char **argv) {
+  uint32_t colors[64];
+  palette pal;
+  int rounds = argc > 1 ? atoi(argv[1]) : 5000;
+  int i;
+
+  /* every byte of every color different, and indices with junk in the
+   * top bits, which have to be ignored */
+  for (i = 0; i < 64; i++)
+    colors[i] = 0x01000000u * (255 - i) + 0x010000 * (i * 3) + 0x0100 * (i * 5 + 7) + i;
+  for (i = 0; i < 240 * 256; i++)
+    frame[i] = rand();
+  palette_init(&pal, colors);
+  palette_scalar(&pal, want, PITCH, frame);
+
+  bench("scalar", palette_scalar, &pal, rounds);
+  bench("sse4.1", palette_sse4, &pal, rounds);
+  bench("avx2", palette_avx2, &pal, rounds);
+  return 0;
+}
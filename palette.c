@@ -0,0 +1,156 @@
+/*
+ * palette.c
+ * by Max Willsey
+ * turns frames of NES palette indices into 32 bit pixels
+ */
+
+#include <stddef.h>
+
+#include "palette.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PALETTE_X86
+#include <immintrin.h>
+#endif
+
+void palette_init (palette *pal, const uint32_t colors[64]) {
+  int i, k;
+  for (i = 0; i < 64; i++) {
+    pal->colors[i] = colors[i];
+    for (k = 0; k < 4; k++)
+      pal->planes[k][i] = colors[i] >> (8 * k);
+  }
+}
+
+static void convert_scalar (const palette *pal, void *dst, int pitch,
+                            const uint8_t *src) {
+  uint32_t *row;
+  int y, x;
+  for (y = 0; y < 240; y++) {
+    row = (uint32_t*)((uint8_t*)dst + (size_t)y * pitch);
+    for (x = 0; x < 256; x++)
+      row[x] = pal->colors[src[y * 256 + x] & 63];
+  }
+}
+
+#ifdef PALETTE_X86
+
+/* pshufb looks bytes up in a 16 entry table, so each byte of the color
+ * comes from 4 lookups (one per quarter of the palette) blended on bits 4
+ * and 5 of the index. Then the 4 byte planes are interleaved into pixels */
+
+__attribute__((target("sse4.1")))
+static void convert_sse4 (const palette *pal, void *dst, int pitch,
+                          const uint8_t *src) {
+  __m128i t[4][4], p[4], idx, lo, b4, b5, a, b, rg, ba;
+  __m128i *out;
+  int y, x, k;
+
+  for (k = 0; k < 4; k++)
+    for (x = 0; x < 4; x++)
+      t[k][x] = _mm_loadu_si128((const __m128i*)&pal->planes[k][16 * x]);
+
+  for (y = 0; y < 240; y++) {
+    out = (__m128i*)((uint8_t*)dst + (size_t)y * pitch);
+    for (x = 0; x < 256; x += 16) {
+      idx = _mm_and_si128(_mm_loadu_si128((const __m128i*)&src[y * 256 + x]),
+                          _mm_set1_epi8(63));
+      lo = _mm_and_si128(idx, _mm_set1_epi8(15));
+      /* blendv goes by the top bit of each byte */
+      b4 = _mm_slli_epi16(idx, 3);
+      b5 = _mm_slli_epi16(idx, 2);
+      for (k = 0; k < 4; k++) {
+        a = _mm_blendv_epi8(_mm_shuffle_epi8(t[k][0], lo),
+                            _mm_shuffle_epi8(t[k][1], lo), b4);
+        b = _mm_blendv_epi8(_mm_shuffle_epi8(t[k][2], lo),
+                            _mm_shuffle_epi8(t[k][3], lo), b4);
+        p[k] = _mm_blendv_epi8(a, b, b5);
+      }
+      rg = _mm_unpacklo_epi8(p[0], p[1]);
+      ba = _mm_unpacklo_epi8(p[2], p[3]);
+      _mm_storeu_si128(out++, _mm_unpacklo_epi16(rg, ba));
+      _mm_storeu_si128(out++, _mm_unpackhi_epi16(rg, ba));
+      rg = _mm_unpackhi_epi8(p[0], p[1]);
+      ba = _mm_unpackhi_epi8(p[2], p[3]);
+      _mm_storeu_si128(out++, _mm_unpacklo_epi16(rg, ba));
+      _mm_storeu_si128(out++, _mm_unpackhi_epi16(rg, ba));
+    }
+  }
+}
+
+/* the same 32 pixels at a time. vpshufb and the unpacks work within each
+ * 128 bit lane, so the tables go in both lanes and the halves of the
+ * results have to be put back in order */
+__attribute__((target("avx2")))
+static void convert_avx2 (const palette *pal, void *dst, int pitch,
+                          const uint8_t *src) {
+  __m256i t[4][4], p[4], idx, lo, b4, b5, a, b, rg, ba, q0, q1, q2, q3;
+  __m256i *out;
+  int y, x, k;
+
+  for (k = 0; k < 4; k++)
+    for (x = 0; x < 4; x++)
+      t[k][x] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)&pal->planes[k][16 * x]));
+
+  for (y = 0; y < 240; y++) {
+    out = (__m256i*)((uint8_t*)dst + (size_t)y * pitch);
+    for (x = 0; x < 256; x += 32) {
+      idx = _mm256_and_si256(
+        _mm256_loadu_si256((const __m256i*)&src[y * 256 + x]),
+        _mm256_set1_epi8(63));
+      lo = _mm256_and_si256(idx, _mm256_set1_epi8(15));
+      b4 = _mm256_slli_epi16(idx, 3);
+      b5 = _mm256_slli_epi16(idx, 2);
+      for (k = 0; k < 4; k++) {
+        a = _mm256_blendv_epi8(_mm256_shuffle_epi8(t[k][0], lo),
+                               _mm256_shuffle_epi8(t[k][1], lo), b4);
+        b = _mm256_blendv_epi8(_mm256_shuffle_epi8(t[k][2], lo),
+                               _mm256_shuffle_epi8(t[k][3], lo), b4);
+        p[k] = _mm256_blendv_epi8(a, b, b5);
+      }
+      /* q0 is pixels 0-3 and 16-19, q1 4-7 and 20-23, and so on */
+      rg = _mm256_unpacklo_epi8(p[0], p[1]);
+      ba = _mm256_unpacklo_epi8(p[2], p[3]);
+      q0 = _mm256_unpacklo_epi16(rg, ba);
+      q1 = _mm256_unpackhi_epi16(rg, ba);
+      rg = _mm256_unpackhi_epi8(p[0], p[1]);
+      ba = _mm256_unpackhi_epi8(p[2], p[3]);
+      q2 = _mm256_unpacklo_epi16(rg, ba);
+      q3 = _mm256_unpackhi_epi16(rg, ba);
+      _mm256_storeu_si256(out++, _mm256_permute2x128_si256(q0, q1, 0x20));
+      _mm256_storeu_si256(out++, _mm256_permute2x128_si256(q2, q3, 0x20));
+      _mm256_storeu_si256(out++, _mm256_permute2x128_si256(q0, q1, 0x31));
+      _mm256_storeu_si256(out++, _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+  }
+}
+
+const palette_fn palette_sse4 = &convert_sse4;
+const palette_fn palette_avx2 = &convert_avx2;
+#else
+const palette_fn palette_sse4 = NULL;
+const palette_fn palette_avx2 = NULL;
+#endif
+
+const palette_fn palette_scalar = &convert_scalar;
+
+/* the best version this machine can run, picked on the first call */
+static palette_fn best (void) {
+#ifdef PALETTE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return palette_avx2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return palette_sse4;
+#endif
+  return palette_scalar;
+}
+
+void palette_convert (const palette *pal, void *dst, int pitch,
+                      const uint8_t *src) {
+  static palette_fn fn = NULL;
+  if (!fn)
+    fn = best();
+  fn(pal, dst, pitch, src);
+}
@@ -0,0 +1,25 @@
+/*
+ * palette.h
+ * by Max Willsey
+ * turns frames of NES palette indices into 32 bit pixels
+ */
+
+#include <stdint.h>
+
+/* the 64 colors as 32 bit pixels in whatever format the screen wants, and
+ * split into their 4 bytes for the vector versions */
+typedef struct {
+  uint32_t colors[64];
+  uint8_t planes[4][64];
+} palette;
+
+void palette_init (palette *pal, const uint32_t colors[64]);
+
+/* convert a 256x240 frame, pitch is the bytes between rows of dst */
+void palette_convert (const palette *pal, void *dst, int pitch, const uint8_t *src);
+
+/* the versions palette_convert picks from, the vector ones are NULL when
+ * the machine (or compiler) doesn't have them */
+typedef void (*palette_fn) (const palette *pal, void *dst, int pitch,
+                            const uint8_t *src);
+extern const palette_fn palette_scalar, palette_sse4, palette_avx2;
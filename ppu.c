@@ -7,11 +7,231 @@
 #include "nes.h"
 
 
+/* the background is drawn a whole line at a time at dot 256, unless the
+ * cpu changes something the background depends on partway through the
+ * line. Then the line is drawn up to that dot and the rest of it is drawn
+ * a dot at a time, so raster effects still land on the right pixel */
+
+/* pattern tables are kept decoded, a byte per pixel, in chr_cache. A tile
+ * is decoded again the first time it's used after its bytes change */
+
+/* the cpu wrote chr ram, or a mapper switched banks, in [start, end] */
+void ppu_chr_dirty (nes *n, addr start, addr end) {
+  memset(&n->p->chr_dirty[start >> 4], 1, ((end - start) >> 4) + 1);
+}
+
+/* a byte of chr ram at a was written. The same ram can be mapped into
+ * more than one pattern window, so the tile's dirty in all of them */
+static void ppu_chr_written (ppu *p, addr a) {
+  byte *page = p->mem->read_pages[a >> MEM_PAGE_BITS];
+  int i;
+  for (i = 0; i < 0x2000 >> MEM_PAGE_BITS; i++)
+    if (p->mem->read_pages[i] == page)
+      p->chr_dirty[((i << MEM_PAGE_BITS) | (a & (MEM_PAGE_SIZE - 1))) >> 4] = 1;
+}
+
+static byte *ppu_tile (ppu *p, int tile) {
+  byte *pix = p->chr_cache[tile];
+  byte lo, hi;
+  int y, x;
+  if (p->chr_dirty[tile]) {
+    for (y = 0; y < 8; y++) {
+      lo = mem_read(p->mem, (tile << 4) + y);
+      hi = mem_read(p->mem, (tile << 4) + y + 8);
+      for (x = 0; x < 8; x++)
+        pix[y * 8 + x] = ((lo >> (7 - x)) & 1) | (((hi >> (7 - x)) & 1) << 1);
+    }
+    p->chr_dirty[tile] = 0;
+  }
+  return pix;
+}
+
+/* draw the background indices (0 is transparent) of [x, end) into out */
+static void ppu_render_bg (ppu *p, byte *out, int x, int end) {
+  int fine_y, coarse_y, pos, col, i;
+  addr nt_y, nt;
+  byte at, pal, pix, *row;
+  int pt;
+
+  if (!(p->mask & 0x08)) {
+    memset(out + x, 0, end - x);
+    return;
+  }
+
+  /* the vertical part of the vram address says which row we're on */
+  fine_y = p->addr >> 12;
+  coarse_y = (p->addr >> 5) & 31;
+  nt_y = p->addr & 0x0800;
+  pt = (p->ctrl & 0x10) << 4;
+
+  while (x < end) {
+    /* the two horizontal nametables are 512 pixels wide together */
+    pos = (p->line_x + x) & 511;
+    col = pos >> 3;
+    nt = 0x2000 | nt_y | ((col & 32) << 5);
+    row = ppu_tile(p, pt | mem_read(p->mem, nt | (coarse_y << 5) | (col & 31)));
+    row += fine_y * 8;
+    at = mem_read(p->mem, nt | 0x03c0 | ((coarse_y >> 2) << 3) | ((col & 31) >> 2));
+    pal = ((at >> (((coarse_y & 2) << 1) | (col & 2))) & 3) << 2;
+
+    for (i = pos & 7; i < 8 && x < end; i++, x++) {
+      pix = row[i];
+      /* the left 8 pixels can be clipped */
+      if (x < 8 && !(p->mask & 0x02))
+        pix = 0;
+      out[x] = pix ? pal | pix : 0;
+    }
+  }
+}
+
+/* draw the current line from where we left off up to (not including)
+ * pixel end, putting the line's sprites over the background */
+static void ppu_render (ppu *p, int end) {
+  byte *out = p->frame_buffer[p->scanline];
+  byte gray = (p->mask & 0x01) ? 0x30 : 0x3f;
+  bit sprites = (p->mask & 0x10) && p->spr_count;
+  int x = p->line_drawn;
+  byte bg, spr;
+
+  if (x >= end)
+    return;
+  p->line_drawn = end;
+
+  ppu_render_bg(p, out, x, end);
+
+  for (; x < end; x++) {
+    bg = out[x];
+    spr = sprites && (x >= 8 || (p->mask & 0x04)) ? p->spr_line[x] : 0;
+    if (spr) {
+      /* sprite 0 hit, the real thing never hits on the last pixel */
+      if ((spr & SPR_ZERO) && bg && x != 255)
+        p->status |= 0x40;
+      if (!bg || !(spr & SPR_BEHIND)) {
+        out[x] = p->palette[0x10 | (spr & 0x0f)] & gray;
+        continue;
+      }
+    }
+    out[x] = p->palette[bg] & gray;
+  }
+}
+
+/* sprites are kept in oam_order sorted by y, so the ones on a line are
+ * found without looking at all 64. The index is rebuilt when oam changes,
+ * and the cursor into it goes back to the start when the sprite height
+ * does */
+static void ppu_sort_oam (ppu *p) {
+  int i, j;
+  byte k;
+  for (i = 0; i < 64; i++) {
+    k = i;
+    /* insertion sort, stable so equal y stays in oam order */
+    for (j = i; j > 0 && p->oam1[p->oam_order[j - 1]][0] > p->oam1[k][0]; j--)
+      p->oam_order[j] = p->oam_order[j - 1];
+    p->oam_order[j] = k;
+  }
+  p->oam_dirty = 0;
+  p->oam_next = 0;
+}
+
+/* find the first 8 sprites (in oam order) on the current line, copy them
+ * to oam2 and draw them into spr_line */
+static void ppu_eval_sprites (ppu *p) {
+  int line = p->scanline;
+  int h = (p->ctrl & 0x20) ? 16 : 8;
+  byte found[64];
+  int count = 0, i, j, x, row;
+  byte k, *s, *pix, attr, tile, v;
+  int t;
+
+  if (p->oam_dirty)
+    ppu_sort_oam(p);
+
+  /* a sprite at y shows on lines y+1 to y+h */
+  while (p->oam_next < 64 && p->oam1[p->oam_order[p->oam_next]][0] + h < line)
+    p->oam_next++;
+  for (i = p->oam_next; i < 64 && p->oam1[p->oam_order[i]][0] < line; i++) {
+    k = p->oam_order[i];
+    /* keep them in oam order, there are rarely more than a few */
+    for (j = count; j > 0 && found[j - 1] > k; j--)
+      found[j] = found[j - 1];
+    found[j] = k;
+    count++;
+  }
+
+  if (count > 8) {
+    p->status |= 0x20;
+    count = 8;
+  }
+  p->spr_count = count;
+  if (!count)
+    return;
+
+  memset(p->spr_line, 0, sizeof(p->spr_line));
+  for (i = 0; i < count; i++) {
+    s = p->oam1[found[i]];
+    memcpy(p->oam2[i], s, 4);
+    attr = s[2];
+    row = line - s[0] - 1;
+    if (attr & 0x80)
+      row = h - 1 - row;
+    if (h == 16) {
+      /* 8x16 sprites pick their table with bit 0 of the tile */
+      tile = s[1] & 0xfe;
+      t = ((s[1] & 1) << 8) | (tile + (row >> 3));
+    } else {
+      t = ((p->ctrl & 0x08) << 5) | s[1];
+    }
+    pix = ppu_tile(p, t) + (row & 7) * 8;
+
+    for (j = 0; j < 8; j++) {
+      x = s[3] + j;
+      /* earlier sprites win, even when they're behind the background */
+      if (x > 255 || p->spr_line[x])
+        continue;
+      v = pix[(attr & 0x40) ? 7 - j : j];
+      if (v)
+        p->spr_line[x] = ((attr & 3) << 2) | v | ((attr & 0x20) ? SPR_BEHIND : 0) |
+          (found[i] == 0 ? SPR_ZERO : 0);
+    }
+    /* sprite 0 hits have to show up on the right dot */
+    if (found[i] == 0 && (p->mask & 0x18) == 0x18)
+      p->dot_mode = 1;
+  }
+}
+
+/* where the first pixel of the line is, given the vram address and fine x */
+static int line_start (ppu *p) {
+  return ((p->addr & 0x1f) << 3 | (p->addr & 0x0400) >> 2) + p->fine_x;
+}
+
+/* the cpu is about to change something the background is drawn from. If
+ * that's in the middle of a visible line, draw what's been done so far and
+ * finish the line a dot at a time */
+void ppu_line_split (nes *n) {
+  ppu *p = n->p;
+  ppu_catch_up(n);
+  if (p->scanline <= 239 && p->cycle >= 1 && p->cycle <= 256) {
+    PROF_ENTER(n, PROF_PPU);
+    ppu_render(p, p->cycle - 1);
+    p->dot_mode = 1;
+    PROF_LEAVE(n);
+  }
+}
+
+
 /* PPU I/O registers */
 
 /* Controller ($2000) > write */
 void wcb_2000 (nes* n, byte b) {
+  /* turning NMIs on during vblank gets one right away */
+  if (!(n->p->ctrl & 0x80) && (b & 0x80) && (n->p->status & 0x80))
+    n->c->nmi = 1;
+  /* taller sprites reach lines the sprite cursor has gone past */
+  if ((n->p->ctrl ^ b) & 0x20)
+    n->p->oam_next = 0;
   n->p->ctrl = b; 
+  /* the nametable select goes into the temporary address */
+  n->p->tmp = (n->p->tmp & 0xf3ff) | ((b & 3) << 10);
 }
 
 /* Mask ($2001) > write */
@@ -25,321 +245,388 @@ byte rcb_2002 (nes *n) {
   n->p->first_write = 1;
   /* reset vblank bit */
   byte b = n->p->status;
-  printf("reading 2002: getting %02x\n", b);
   n->p->status &= 0x7f;
   return b;
 }
 
 /* OAM address ($2003) > write */
 void wcb_2003 (nes* n, byte b) {
-  /* not supported right now */
-  if  (b != 0x00)
-    printf("OAMADDR is not supported right now\n");
   n->p->oam_addr = b; 
 }  
 
-/* OAM data ($2004) <> read/write (only write for now) */
+/* OAM data ($2004) <> read/write */
+byte rcb_2004 (nes* n) {
+  ppu *p = n->p;
+  byte b = p->oam1[p->oam_addr >> 2][p->oam_addr & 3];
+  /* the unused attribute bits aren't there */
+  return (p->oam_addr & 3) == 2 ? b & 0xe3 : b;
+}
 void wcb_2004 (nes* n, byte b) {
-  /* not supported right now */
-  printf("OAMDATA is not implemented\n");
-  n->p->oam_addr++;
-  n->p->oam_data = b; 
+  ppu *p = n->p;
+  p->oam1[p->oam_addr >> 2][p->oam_addr & 3] = b;
+  p->oam_addr++;
+  p->oam_dirty = 1;
 }  
 
 /* Scroll ($2005) >> write x2 */
 void wcb_2005 (nes* n, byte b) {
-  /* write into x/y depending on latch */
-  if (n->p->first_write)
-    n->p->scrollx = b;
-  else
-    n->p->scrolly = b;
+  ppu *p = n->p;
+  /* x then y, both go into the temporary address except fine x */
+  if (p->first_write) {
+    p->tmp = (p->tmp & 0xffe0) | (b >> 3);
+    /* fine x takes effect right away */
+    p->line_x += (b & 7) - p->fine_x;
+    p->fine_x = b & 7;
+  } else {
+    p->tmp = (p->tmp & 0x0c1f) | ((b & 7) << 12) | ((b & 0xf8) << 2);
+  }
   /* flip first_write */
-  n->p->first_write = !n->p->first_write;
+  p->first_write = !p->first_write;
 }  
 
 /* Address ($2006) >> write x2 */
 void wcb_2006 (nes* n, byte b) {
-  /* clear then write to spot indicated by first_write latch */
-  if (n->p->first_write)
-    n->p->addr = (n->p->addr & 0x00ff) | (b << 8);
-  else
-    n->p->addr = (n->p->addr & 0xff00) | b;
+  ppu *p = n->p;
+  /* high byte (only 6 bits of it) then low byte, which loads the address */
+  if (p->first_write) {
+    p->tmp = (p->tmp & 0x00ff) | ((b & 0x3f) << 8);
+  } else {
+    p->tmp = (p->tmp & 0xff00) | b;
+    p->addr = p->tmp;
+    /* the rest of the line comes from the new address */
+    p->line_x = line_start(p) - (p->cycle ? p->cycle - 1 : 0);
+  }
   /* flip first_write */
-  n->p->first_write = !n->p->first_write;
+  p->first_write = !p->first_write;
 }  
 
 /* Data ($2007) <> read/write */
 byte rcb_2007 (nes* n) {
-  /* read from the address in VRAM */
-  byte b = mem_read(n->p->mem, n->p->addr);
+  ppu *p = n->p;
+  addr a = p->addr & 0x3fff;
+  byte b;
+  /* reads come from a buffer filled by the last read, except the palettes */
+  if (a >= 0x3f00) {
+    b = mem_read(p->mem, a);
+    /* the nametable byte underneath still goes into the buffer */
+    p->data_buffer = mem_read(p->mem, a - 0x1000);
+  } else {
+    b = p->data_buffer;
+    p->data_buffer = mem_read(p->mem, a);
+  }
   /* increment ppuaddr based on A2 */
-  if (n->p->ctrl & 0x05)
-    n->p->addr += 32;
-  else
-    n->p->addr += 1;
+  p->addr += (p->ctrl & 0x04) ? 32 : 1;
   return b;
 }
 void wcb_2007 (nes* n, byte b) {
+  addr a = n->p->addr & 0x3fff;
   /* write this to the address in VRAM */
-  mem_write(n->p->mem, n->p->addr, b);
-  printf("writing to vram \n");
+  mem_write(n->p->mem, a, b);
+  if (a < 0x2000)
+    ppu_chr_written(n->p, a);
   /* increment ppuaddr based on A2 */
-  if (n->p->ctrl & 0x05)
-    n->p->addr += 32;
-  else
-    n->p->addr += 1;    
+  n->p->addr += (n->p->ctrl & 0x04) ? 32 : 1;
 }
 
-void ppu_cycle_inc (ppu *p) {
-  p->cycle++;
-  if (p->cycle > 340) {
-    p->cycle = 0;
-    p->scanline++;
-    if (p->scanline > 261) {
-      p->scanline = 0;
-      p->even_frame = !p->even_frame;
-    }
+/* the registers are mirrored every 8 bytes from $2000 to $3fff */
+byte ppu_read_reg (nes *n, addr a) {
+  ppu_catch_up(n);
+  switch (a & 7) {
+  case 2: return rcb_2002(n);
+  case 4: return rcb_2004(n);
+  case 7: return rcb_2007(n);
+  default: return 0;
   }
 }
 
-void ppu_read_nt (ppu *p) {
-  addr nt_base_addr = 0x2000 + 0x400 * (p->ctrl & 0x4);
-  addr nt_offset = (p->scanline / 8)*32 + ((p->cycle + 16) / 8);
-  p->nt_entry =  mem_read(p->mem, nt_base_addr + nt_offset);
+void ppu_write_reg (nes *n, addr a, byte b) {
+  ppu_line_split(n);
+  switch (a & 7) {
+  case 0: wcb_2000(n, b); break;
+  case 1: wcb_2001(n, b); break;
+  case 3: wcb_2003(n, b); break;
+  case 4: wcb_2004(n, b); break;
+  case 5: wcb_2005(n, b); break;
+  case 6: wcb_2006(n, b); break;
+  case 7: wcb_2007(n, b); break;
+  }
 }
 
-void ppu_read_at (ppu *p) {
-  addr at_base_addr = 0x2c30 + 0x400 * (p->ctrl & 0x4);
-  addr at_offset = (p->scanline / 32)*8 + ((p->cycle + 16) / 32);
-  p->at_latch =  mem_read(p->mem, at_base_addr + at_offset);
+/* OAM DMA ($4014), copies a page of cpu memory to oam starting at
+ * oam_addr, once the instruction that wrote it is done. The cpu is stalled
+ * for 513 cycles, plus one more to line up when it starts on an odd cycle.
+ * returns the cycles it took */
+int ppu_oam_dma (nes *n, byte page) {
+  ppu *p = n->p;
+  byte *oam = &p->oam1[0][0];
+  byte *src = n->c->mem->read_pages[page];
+  int start = p->oam_addr, stall, i;
+
+  /* sprites already drawn have to see the old oam */
+  ppu_catch_up(n);
+  if (src) {
+    memcpy(oam + start, src, 256 - start);
+    memcpy(oam, src + 256 - start, start);
+  } else {
+    /* i/o pages have to be read a byte at a time */
+    for (i = 0; i < 256; i++)
+      oam[(start + i) & 0xff] = mem_read(n->c->mem, (page << 8) | i);
+  }
+  p->oam_dirty = 1;
+  stall = 513 + (n->c->cycles & 1);
+  n->c->cycles += stall;
+  return stall;
 }
 
-void ppu_read_pt (ppu *p, bit hi) {
-  addr pt_base_addr = ((p->ctrl >> 4) & 1) ? 0x1000 : 0x0000;
-  addr pt_offset = ((addr)p->nt_entry << 4) + (p->scanline & 8);
-  if (hi) 
-    p->pt_latch_hi = mem_read(p->mem, pt_base_addr + pt_offset + 8);
-  else 
-    p->pt_latch_lo = mem_read(p->mem, pt_base_addr + pt_offset);
+/* 32 bytes of palette mirrored up to $3fff, where the sprite backdrop
+ * entries $3f10/$3f14/$3f18/$3f1c are the background ones */
+static byte palette_index (addr a) {
+  a &= 0x1f;
+  return (a & 0x13) == 0x10 ? a & 0x0f : a;
 }
 
-void render_run (ppu *p) {
-  byte bg_palette, pixel, color;
-  /* loop unit is one clock */
-  while (1) {
-    sem_wait(p->render_clock);
-    /* find out which palette we're using */
-    bg_palette = 0x3f01 + 3 * (p->at_latch >> ((p->cycle % 32 / 8) * 2));
-    /* make the pixel from the bit pattern */
-    pixel = ((p->pt_shift_hi >> i) << p->cycle % 8) |
-      (p->pt_shift_lo >> p->cycle % 8);
-    /* get the color from the palette (or universal bg color) */
-    color = pixel ? mem_read(p->mem, bg_palette + pixel) : mem_read(p->mem, 0x3f00);
-    /* draw it */
-    p->frame_buffer[p->scanline][p->cycle] = color;
-  }
+byte ppu_read_palette (nes *n, addr a) {
+  return n->p->palette[palette_index(a)];
 }
 
-void bg_run (ppu *p) {
-  while (1) {
-    for 
-    switch (p->cycle % 8) {
-      case 1:
-        ppu_read_nt(p);
-        break;
-      case 3:
-        ppu_read_at(p);
-        break;
-      case 5:
-        ppu_read_pt(p, 0);
-        break;
-      case 7:
-        ppu_read_pt(p, 1);
-        /* shift and load from latches*/
-        p->at_shift = (p->at_shift >> 8) | ((addr)(p->at_latch << 8));
-        p->pt_shift_lo = (p->pt_shift_lo >> 8) | ((addr)(p->pt_latch_lo << 8));
-        p->pt_shift_hi = (p->pt_shift_hi >> 8) | ((addr)(p->pt_latch_hi << 8));
-        break;
-      }
-
-  }
+void ppu_write_palette (nes *n, addr a, byte b) {
+  n->p->palette[palette_index(a)] = b & 0x3f;
 }
 
-void oam_run (ppu *p) {
-  while (1) {
-
+/* move the dot counter on, dots never takes it past the end of a line */
+static void ppu_advance (ppu *p, int dots) {
+  p->clock += dots;
+  p->cycle += dots;
+  if (p->cycle > 340) {
+    p->cycle = 0;
+    p->scanline++;
+    if (p->scanline > 261) {
+      p->scanline = 0;
+      p->even_frame = !p->even_frame;
+      p->frames++;
+    }
   }
 }
 
-
-void ppu_run (nes *n) {
-  ppu *p = n->p;
-  
-  while (1) {  
-    /* wait for a clock, then give it to components */
-    sem_wait(p->clock);
-    sem_post(p->render_clock);
-    sem_post(p->bg_clock);
-    sem_post(p->oam_clock);
-
-    /* propertly increment cycle */
-    p->cycle++;
-    if (p->cycle > 340) {
-      p->cycle = 0;
-      p->scanline++;
-      if (p->scanline > 261) {
-        p->scanline = 0;
-        p->even_frame = !p->even_frame;
-      }
-    }
-
+/* move the vram address down a pixel row, at the end of each line */
+static void ppu_inc_y (ppu *p) {
+  int y;
+  if ((p->addr & 0x7000) != 0x7000) {
+    p->addr += 0x1000;
+    return;
   }
-
-  /* clean up? */
-  
+  p->addr &= 0x0fff;
+  y = (p->addr >> 5) & 31;
+  if (y == 29) {
+    /* bottom of the nametable, go to the one below */
+    y = 0;
+    p->addr ^= 0x0800;
+  } else if (y == 31) {
+    /* out in the attribute bytes, wraps without switching */
+    y = 0;
+  } else {
+    y++;
+  }
+  p->addr = (p->addr & 0xfc1f) | (y << 5);
 }
 
-void ppu_step (nes *n) {
+/* runs the dot the ppu is on */
+static void ppu_step (nes *n) {
   ppu* p = n->p;
-  addr bg_palette;
-  byte pix;
-  int i;
+  bit rendering = (p->mask & 0x18) != 0;
 
-  sem_post(p->render_clock);
-
-  //printf("cycle: %d, scanline: %d\n",p->cycle, p->scanline);
+  /* the mmc3 counts scanlines about here, when the sprite fetches start */
+  if (p->cycle == 260 && (p->scanline <= 239 || p->scanline == 261) &&
+      rendering && n->mapper.scanline)
+    n->mapper.scanline(n);
 
   if (p->scanline <= 239) {
     /* visible scanlines */
 
     if (p->cycle == 0) {
-      /* this is an idle cycle */
+      /* idle, get ready to draw the line */
+      p->line_x = line_start(p);
+      p->line_drawn = 0;
+      p->dot_mode = 0;
+      p->spr_count = 0;
+      if (rendering)
+        ppu_eval_sprites(p);
     }
 
     else if (p->cycle <= 256) {
-    /*   /\* oam stuff *\/ */
-    /*   if (p->cycle <= 64 && p->cycle % 2) { */
-    /*     /\* clearing oam2 *\/ */
-    /*     oam2[p->cycle / 4][p->cycle % 4] = 0xff; */
-    /*   } else { */
-    /*     /\* sprite handling *\/ */
-    /*     int n = 0; */
-    /*     int m = 0; */
-    /*     int oam2_open = 0; */
-    /*     byte b; */
-        
-    /*     while (oam2_open < 8) { */
-    /*       b = oam1[n][0]; */
-    /*       oam2[oam2_open][0] = b; */
-    /*       if (0 <= p->scanline - b && p->scanline - b < 8) { */
-    /*         /\* sprite is in range, take the whole thing *\/ */
-    /*         oam2[oam2_open][1] = oam1[n][1]; */
-    /*         oam2[oam2_open][2] = oam1[n][2]; */
-    /*         oam2[oam2_open][3] = oam1[n][3]; */
-    /*         oam2_open++ */
-    /*       } */
-          
-    /*     } */
-          
-
-      i = p->cycle % 8;
-      bg_palette = 0x3f01 + 3 * (p->at_latch >> ((p->cycle % 32 / 8) * 2));
-      pix = ((p->pt_shift_hi >> i) << 1) | (p->pt_shift_lo >> i);
-      pix = pix ? mem_read(p->mem, bg_palette + pix) : mem_read(p->mem, 0x3f00);
-      p->frame_buffer[p->scanline][p->cycle] = pix;
-      switch (p->cycle % 8) {
-      case 1:
-        ppu_read_nt(p);
-        break;
-      case 3:
-        ppu_read_at(p);
-        break;
-      case 5:
-        ppu_read_pt(p, 0);
-        break;
-      case 7:
-        ppu_read_pt(p, 1);
-        /* shift and load from latches*/
-        p->at_shift = (p->at_shift >> 8) | ((addr)(p->at_latch << 8));
-        p->pt_shift_lo = (p->pt_shift_lo >> 8) | ((addr)(p->pt_latch_lo << 8));
-        p->pt_shift_hi = (p->pt_shift_hi >> 8) | ((addr)(p->pt_latch_hi << 8));
-        break;
+      if (p->dot_mode)
+        ppu_render(p, p->cycle);
+      if (p->cycle == 256) {
+        ppu_render(p, 256);
+        if (rendering)
+          ppu_inc_y(p);
       }
     }
 
-    else if(p->cycle <= 320) {
-      /* fetch sprites for next scanline */
+    else if (p->cycle == 257 && rendering) {
+      /* back to the left edge for the next line */
+      p->addr = (p->addr & 0xfbe0) | (p->tmp & 0x041f);
     }
+  }
 
-    else if(p->cycle <= 336) {
-      /* load the shift registers for next scanline */
-      switch (p->cycle % 8) {
-      case 1:
-        ppu_read_nt(p);
-        break;
-      case 3:
-        ppu_read_at(p);
-        break;
-      case 5:
-        ppu_read_pt(p, 0);
-        break;
-      case 7:
-        ppu_read_pt(p, 1);
-        /* shift and load from latches*/
-        p->at_shift = (p->at_shift >> 8) | ((addr)(p->at_latch << 8));
-        p->pt_shift_lo = (p->pt_shift_lo >> 8) | ((addr)(p->pt_latch_lo << 8));
-        p->pt_shift_hi = (p->pt_shift_hi >> 8) | ((addr)(p->pt_latch_hi << 8));
-        break;
-      }
+  else if (p->scanline == 241 && p->cycle == 1) {
+    /* start of vertical blank */
+    p->status |= 0x80;
+    if (p->ctrl & 0x80)
+      n->c->nmi = 1;
+  }
+
+  else if (p->scanline == 261) {
+    /* pre-render scanline */
+    /* TODO: add in even odd timing? */
+    if (p->cycle == 1) {
+      /* vblank, sprite 0 hit and overflow */
+      p->status &= 0x1f;
+      p->oam_next = 0;
+    }
+    if (rendering) {
+      if (p->cycle == 256)
+        ppu_inc_y(p);
+      else if (p->cycle == 257)
+        p->addr = (p->addr & 0xfbe0) | (p->tmp & 0x041f);
+      else if (p->cycle == 280)
+        /* the real thing does this over dots 280-304 */
+        p->addr = (p->addr & 0x041f) | (p->tmp & 0x7be0);
     }
   }
+}
 
-  else if (p->scanline == 240) {
-    /* visible scanline, just idle*/
+/* the next dot on this line ppu_step has anything to do on, or 341 */
+static int ppu_next_dot (ppu *p) {
+  int c = p->cycle;
+  if (p->scanline <= 239) {
+    if (c == 0 || (p->dot_mode && c <= 256))
+      return c;
+    if (c <= 256) return 256;
+    if (c <= 257) return 257;
+    if (c <= 260) return 260;
+  } else if (p->scanline == 241) {
+    if (c <= 1) return 1;
+  } else if (p->scanline == 261) {
+    if (c <= 1) return 1;
+    if (c <= 256) return 256;
+    if (c <= 257) return 257;
+    if (c <= 260) return 260;
+    if (c <= 280) return 280;
   }
+  return 341;
+}
+
+/* dots from where the ppu is to the given dot, 0 if it's the current one */
+static uint64_t ppu_dots_to (ppu *p, int scanline, int cycle) {
+  int d = (scanline * 341 + cycle) - (p->scanline * 341 + p->cycle);
+  return d < 0 ? d + 262 * 341 : d;
+}
 
-  else if (p->scanline <= 260) {
-    /* vertical blanking lines */
-    if (p->scanline == 241 && p->cycle == 0) 
-      p->status |= 0x80;
+/* when the ppu next does something the cpu can see without asking: the
+ * vblank NMI, the end of the frame, or a mapper's scanline irq */
+static void ppu_set_deadline (nes *n) {
+  ppu *p = n->p;
+  uint64_t d = ppu_dots_to(p, 241, 1);
+  uint64_t e = ppu_dots_to(p, 0, 0);
+  int line;
+  if (e && e < d)
+    d = e;
+  if (n->mapper.scanline) {
+    line = p->scanline;
+    if (p->cycle > 260 || (line >= 240 && line < 261))
+      line = line >= 239 && line < 261 ? 261 : (line + 1) % 262;
+    e = ppu_dots_to(p, line, 260);
+    if (e < d)
+      d = e;
   }
+  p->deadline = p->clock + d;
+}
 
-  else {
-    /* pre-render scanline (261) */
-    /* TODO: add in even odd timing? */
-    p->status &= 0x7f;
+/* the ppu runs 3 dots for every cpu cycle. It's only run when the cpu
+ * touches it or when it hits a deadline, and then it skips straight over
+ * dots where nothing happens. When the cpu touches it that's up to the
+ * cycle of the access, not the start of the instruction */
+void ppu_catch_up (nes *n) {
+  ppu *p = n->p;
+  uint64_t target = cpu_clock(n) * 3;
+  uint64_t skip;
+
+  PROF_ENTER(n, PROF_PPU);
+  while (p->clock < target) {
+    skip = ppu_next_dot(p) - p->cycle;
+    if (skip) {
+      if (skip > target - p->clock)
+        skip = target - p->clock;
+      ppu_advance(p, skip);
+    } else {
+      ppu_step(n);
+      ppu_advance(p, 1);
+    }
   }
+  ppu_set_deadline(n);
+  PROF_LEAVE(n);
+}
 
-  ppu_cycle_inc(p);
-  return;
+/* which 1K of vram each nametable uses in each mirroring mode */
+static const int nametables[5][4] = {
+  [MIRROR_HORIZONTAL]   = {0, 0, 1, 1},
+  [MIRROR_VERTICAL]     = {0, 1, 0, 1},
+  [MIRROR_SINGLE_LOWER] = {0, 0, 0, 0},
+  [MIRROR_SINGLE_UPPER] = {1, 1, 1, 1},
+  [MIRROR_FOUR_SCREEN]  = {0, 1, 2, 3}
+};
+
+/* lay the nametables out in vram, $3000-$3eff mirrors $2000-$2eff */
+void ppu_mirror (nes *n, int mirroring) {
+  ppu *p = n->p;
+  int i;
+  for (i = 0; i < 4; i++) {
+    byte *nt = &p->mem->ram[0x400 * nametables[mirroring][i]];
+    mem_map(p->mem, 0x2000 + 0x400 * i, 0x23ff + 0x400 * i, nt, 0x400);
+    mem_map(p->mem, 0x3000 + 0x400 * i, 
+            i == 3 ? 0x3eff : 0x33ff + 0x400 * i, nt, 0x400);
+  }
 }
 
 void ppu_init (nes *n) {
   ppu *p = n->p;
   p->mem = malloc(sizeof(memory));
-  mem_init(p->mem, 0x4000, n);
+  /* 4K of vram for the nametables (only 2K without four screen mirroring).
+   * The cartridge supplies the pattern tables */
+  mem_init(p->mem, 0x1000, n);
+  mem_map_io(p->mem, 0x0000, 0x1fff, NULL, NULL);
+  mem_map_io(p->mem, 0x3f00, 0x3fff, &ppu_read_palette, &ppu_write_palette);
+  ppu_mirror(n, MIRROR_HORIZONTAL);
+  memset(p->palette, 0, sizeof(p->palette));
   p->scanline = 0;
   p->cycle = 0;
+  p->frames = 0;
+  p->clock = 0;
+  p->even_frame = 0;
 
   p->first_write = 1;
+  p->addr = p->tmp = 0;
+  p->fine_x = 0;
+  p->data_buffer = 0;
+  p->ctrl = p->mask = p->status = p->oam_addr = 0;
+  p->line_x = p->line_drawn = 0;
+  p->dot_mode = 0;
+  memset(p->chr_dirty, 1, sizeof(p->chr_dirty));
+  memset(p->oam1, 0xff, sizeof(p->oam1));
+  p->oam_dirty = 1;
+  p->spr_count = 0;
 
   /* we want NMIs */
   /* p->ctrl |= 0x80; */
 
-  /* install write callbacks in CPU address space */
-  n->c->mem->write_cbs[0x2000] = &wcb_2000;
-  n->c->mem->write_cbs[0x2001] = &wcb_2001;
-  n->c->mem->write_cbs[0x2003] = &wcb_2003;
-  n->c->mem->write_cbs[0x2004] = &wcb_2004;
-  n->c->mem->write_cbs[0x2005] = &wcb_2005;
-  n->c->mem->write_cbs[0x2006] = &wcb_2006;
-  n->c->mem->write_cbs[0x2007] = &wcb_2007;
-  /* now read callbacks */
-  n->c->mem->read_cbs[0x2002] = &rcb_2002;
-  n->c->mem->read_cbs[0x2007] = &rcb_2007;
+  /* install the registers in CPU address space */
+  mem_map_io(n->c->mem, 0x2000, 0x3fff, &ppu_read_reg, &ppu_write_reg);
+  ppu_set_deadline(n);
 }
 
 void ppu_destroy (nes *n) {
+  mem_destroy(n->p->mem);
   free(n->p->mem);
 }
 
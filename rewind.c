@@ -0,0 +1,190 @@
+/*
+ * rewind.c
+ * by Max Willsey
+ * keeps the last few seconds of save states so the game can be rewound
+ */
+
+#include "nes.h"
+
+/* every frame's state is XORed against the last keyframe and the result is
+ * run length encoded, so only what changed since the keyframe is kept. A
+ * keyframe is the same thing XORed against nothing. The records go round
+ * a fixed size arena, pushing out the oldest when it fills up */
+
+/* the encoding is a list of runs: 2 bytes of unchanged bytes to skip, 2
+ * bytes of changed bytes, then those bytes XORed. Returns its size */
+static size_t xor_encode (byte *out, byte *a, byte *b, size_t size) {
+  size_t i = 0, o = 0, skip, start, count;
+  uint16_t h[2];
+
+  while (i < size) {
+    start = i;
+    while (i < size && a[i] == (b ? b[i] : 0))
+      i++;
+    if (i == size)
+      break;
+    skip = i - start;
+    while (skip > 0xffff) {
+      h[0] = 0xffff;
+      h[1] = 0;
+      memcpy(out + o, h, 4);
+      o += 4;
+      skip -= 0xffff;
+    }
+
+    /* changed bytes run until 4 unchanged ones in a row */
+    start = i;
+    count = 0;
+    while (i < size && i - start < 0xffff && count < 4) {
+      count = a[i] != (b ? b[i] : 0) ? 0 : count + 1;
+      i++;
+    }
+    i -= count;
+    h[0] = skip;
+    h[1] = i - start;
+    memcpy(out + o, h, 4);
+    o += 4;
+    for (; start < i; start++)
+      out[o++] = a[start] ^ (b ? b[start] : 0);
+  }
+  return o;
+}
+
+/* XORs an encoding onto state */
+static void xor_decode (byte *state, byte *in, size_t size) {
+  size_t i = 0, pos = 0;
+  uint16_t h[2];
+  int j;
+
+  while (i < size) {
+    memcpy(h, in + i, 4);
+    i += 4;
+    pos += h[0];
+    for (j = 0; j < h[1]; j++)
+      state[pos++] ^= in[i++];
+  }
+}
+
+/* keep up to frames states in budget bytes, with a keyframe every
+ * interval frames. returns -1 if the budget can't even hold a keyframe */
+int rewind_init (rewind_buf *r, nes *n, int frames, size_t budget, int interval) {
+  r->state_size = nes_state_size(n);
+  /* worst case encoding is a run header for every 5 bytes */
+  if (budget < r->state_size * 2 + 16) {
+    fprintf(stderr, "A rewind budget of %zu bytes is too small.\n", budget);
+    return -1;
+  }
+  r->budget = budget;
+  r->arena = malloc(budget);
+  r->capacity = frames;
+  r->entries = malloc(sizeof(rewind_entry) * frames);
+  r->start = r->count = 0;
+  r->head = 0;
+  r->interval = interval;
+  r->since_key = interval;
+  r->cur = malloc(r->state_size);
+  r->key = malloc(r->state_size);
+  r->scratch = malloc(r->state_size * 2 + 16);
+  return 0;
+}
+
+/* forget the oldest frame, and any deltas that needed its keyframe */
+static void rewind_drop (rewind_buf *r) {
+  do {
+    r->start = (r->start + 1) % r->capacity;
+    r->count--;
+  } while (r->count && !r->entries[r->start].key);
+}
+
+/* remember the state at the end of this frame */
+void rewind_push (rewind_buf *r, nes *n) {
+  rewind_entry *e;
+  size_t size, o;
+  bit key = r->since_key >= r->interval;
+
+  nes_save_state_buf(n, r->cur, r->state_size);
+  size = xor_encode(r->scratch, r->cur, key ? NULL : r->key, r->state_size);
+  if (key) {
+    memcpy(r->key, r->cur, r->state_size);
+    r->since_key = 0;
+  }
+  r->since_key++;
+
+  if (r->count == r->capacity)
+    rewind_drop(r);
+  /* make room at the head, wrapping round if it won't fit before the end */
+  while (r->count) {
+    o = r->entries[r->start].offset;
+    if (o >= r->head) {
+      if (r->head + size <= o)
+        break;
+      rewind_drop(r);
+    } else if (r->head + size <= r->budget) {
+      break;
+    } else {
+      r->head = 0;
+    }
+  }
+  /* a delta whose keyframe was just pushed out is no use, so the frame
+   * becomes a keyframe. Everything's gone, so the budget has room for it */
+  if (!r->count && !key) {
+    size = xor_encode(r->scratch, r->cur, NULL, r->state_size);
+    memcpy(r->key, r->cur, r->state_size);
+    r->since_key = 1;
+    key = 1;
+  }
+  if (!r->count || r->head + size > r->budget)
+    r->head = 0;
+
+  e = &r->entries[(r->start + r->count) % r->capacity];
+  e->offset = r->head;
+  e->size = size;
+  e->key = key;
+  memcpy(r->arena + r->head, r->scratch, size);
+  r->head += size;
+  r->count++;
+}
+
+/* go back to the last frame pushed and forget it, returns -1 when there's
+ * no history left */
+int rewind_pop (rewind_buf *r, nes *n) {
+  rewind_entry *e, *k;
+  int i;
+
+  if (!r->count)
+    return -1;
+  i = (r->start + r->count - 1) % r->capacity;
+  e = &r->entries[i];
+  /* find its keyframe, the oldest entry is always one */
+  for (k = e; !k->key; k = &r->entries[i])
+    i = (i + r->capacity - 1) % r->capacity;
+
+  memset(r->cur, 0, r->state_size);
+  xor_decode(r->cur, r->arena + k->offset, k->size);
+  if (e != k)
+    xor_decode(r->cur, r->arena + e->offset, e->size);
+  nes_load_state_buf(n, r->cur, r->state_size);
+
+  r->head = e->offset;
+  r->count--;
+  /* the next push can't count on the keyframe still being there */
+  r->since_key = r->interval;
+  return 0;
+}
+
+/* bytes of history being held */
+size_t rewind_used (rewind_buf *r) {
+  size_t used = 0;
+  int i;
+  for (i = 0; i < r->count; i++)
+    used += r->entries[(r->start + i) % r->capacity].size;
+  return used;
+}
+
+void rewind_destroy (rewind_buf *r) {
+  free(r->arena);
+  free(r->entries);
+  free(r->cur);
+  free(r->key);
+  free(r->scratch);
+}
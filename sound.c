@@ -0,0 +1,50 @@
+/*
+ * sound.c
+ * by Max Willsey
+ * plays what the apu makes through SDL
+ */
+
+#include "nes.h"
+#include "sound.h"
+
+#define SOUND_RATE 48000
+
+/* runs on SDL's audio thread, it only ever touches the apu's ring */
+static void sound_callback (void *data, Uint8 *stream, int len) {
+  apu_samples(data, (int16_t*) stream, len / sizeof(int16_t));
+}
+
+/* open the sound card and start the apu making samples for it, keeping
+ * about latency_ms queued. returns -1 if there's no sound to be had */
+int sound_init (sound *s, nes *n, int latency_ms) {
+  SDL_AudioSpec want, have;
+
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO)) {
+    fprintf(stderr, "Could not start SDL audio: %s\n", SDL_GetError());
+    return -1;
+  }
+  memset(&want, 0, sizeof(want));
+  want.freq = SOUND_RATE;
+  want.format = AUDIO_S16SYS;
+  want.channels = 1;
+  want.samples = 512;
+  want.callback = &sound_callback;
+  want.userdata = n->a;
+  s->device = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                  SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (!s->device) {
+    fprintf(stderr, "Could not open audio: %s\n", SDL_GetError());
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    return -1;
+  }
+  s->a = n->a;
+  /* on top of what we keep queued, the card holds a buffer of its own */
+  apu_output(n, have.freq, have.freq * latency_ms / 1000 + have.samples);
+  SDL_PauseAudioDevice(s->device, 0);
+  return 0;
+}
+
+void sound_destroy (sound *s) {
+  SDL_CloseAudioDevice(s->device);
+  SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
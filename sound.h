@@ -0,0 +1,19 @@
+/*
+ * sound.h
+ * by Max Willsey
+ * plays what the apu makes through SDL
+ */
+
+#include <SDL2/SDL.h>
+
+/* from nes.h */
+struct nes_s;
+struct apu_s;
+
+typedef struct {
+  SDL_AudioDeviceID device;
+  struct apu_s *a;
+} sound;
+
+int  sound_init (sound *s, struct nes_s *n, int latency_ms);
+void sound_destroy (sound *s);
@@ -0,0 +1,213 @@
+/*
+ * state.c
+ * by Max Willsey
+ * save states, a snapshot of everything the running machine needs
+ */
+
+#include "nes.h"
+
+/* bump this whenever what's saved changes */
+#define STATE_VERSION 3
+
+/* a state is "NESS", the version, the size of the whole thing, then the
+ * machine. Only live memory goes in, the page tables are rebuilt from
+ * the mapper registers on load */
+
+/* walks the machine in the same order to save, load or just measure. With
+ * no buffer it only counts */
+typedef struct {
+  byte *buf;
+  size_t pos, size;
+  bit loading;
+} stream;
+
+static void field (stream *s, void *p, size_t size) {
+  if (s->buf && s->pos + size <= s->size) {
+    if (s->loading)
+      memcpy(p, s->buf + s->pos, size);
+    else
+      memcpy(s->buf + s->pos, p, size);
+  }
+  s->pos += size;
+}
+
+#define FIELD(s, x) field((s), &(x), sizeof(x))
+
+static void state_io (nes *n, stream *s) {
+  cpu *c = n->c;
+  ppu *p = n->p;
+  apu *a = n->a;
+  mapper *m = &n->mapper;
+
+  /* cpu */
+  FIELD(s, c->A);
+  FIELD(s, c->X);
+  FIELD(s, c->Y);
+  FIELD(s, c->SP);
+  FIELD(s, c->PC);
+  FIELD(s, c->P);
+  FIELD(s, c->nmi);
+  FIELD(s, c->irq);
+  FIELD(s, c->cycles);
+  field(s, c->mem->ram, 0x0800);
+
+  /* ppu */
+  FIELD(s, p->cycle);
+  FIELD(s, p->scanline);
+  FIELD(s, p->even_frame);
+  FIELD(s, p->frames);
+  FIELD(s, p->clock);
+  FIELD(s, p->first_write);
+  FIELD(s, p->ctrl);
+  FIELD(s, p->mask);
+  FIELD(s, p->status);
+  FIELD(s, p->oam_addr);
+  FIELD(s, p->addr);
+  FIELD(s, p->tmp);
+  FIELD(s, p->fine_x);
+  FIELD(s, p->data_buffer);
+  FIELD(s, p->palette);
+  FIELD(s, p->oam1);
+  FIELD(s, p->oam_next);
+  /* the line being drawn, in case we're partway through one */
+  FIELD(s, p->line_x);
+  FIELD(s, p->line_drawn);
+  FIELD(s, p->dot_mode);
+  FIELD(s, p->oam2);
+  FIELD(s, p->spr_count);
+  FIELD(s, p->spr_line);
+  field(s, p->mem->ram, 0x1000);
+
+  /* apu, but not its output */
+  FIELD(s, a->pulse);
+  FIELD(s, a->triangle);
+  FIELD(s, a->noise);
+  FIELD(s, a->dmc);
+  FIELD(s, a->five_step);
+  FIELD(s, a->irq_inhibit);
+  FIELD(s, a->frame_irq);
+  FIELD(s, a->dmc_irq);
+  FIELD(s, a->frame_step);
+  FIELD(s, a->frame_timer);
+  FIELD(s, a->clock);
+
+  /* controllers */
+  FIELD(s, n->pads);
+  FIELD(s, n->pad_shift);
+  FIELD(s, n->strobe);
+
+  /* cartridge */
+  FIELD(s, m->regs);
+  FIELD(s, m->select);
+  FIELD(s, m->shift);
+  FIELD(s, m->shift_count);
+  FIELD(s, m->mirroring);
+  FIELD(s, m->irq_latch);
+  FIELD(s, m->irq_counter);
+  FIELD(s, m->irq_enabled);
+  FIELD(s, m->irq_reload);
+  field(s, n->prg_ram, n->prg_ram_size);
+  if (n->chr_ram)
+    field(s, n->chr_ram, n->chr_ram_size);
+}
+
+/* bytes a state of this machine takes */
+size_t nes_state_size (nes *n) {
+  stream s = {NULL, 0, 0, 0};
+  state_io(n, &s);
+  return s.pos + 12;
+}
+
+/* save into buf, returns the size used, or 0 if buf is too small */
+size_t nes_save_state_buf (nes *n, byte *buf, size_t size) {
+  stream s = {buf, 0, size, 0};
+  uint32_t version = STATE_VERSION;
+  uint32_t total = nes_state_size(n);
+
+  if (size < total)
+    return 0;
+  field(&s, "NESS", 4);
+  FIELD(&s, version);
+  FIELD(&s, total);
+  state_io(n, &s);
+  return total;
+}
+
+/* load a state saved by the same build of the same cartridge, returns 0
+ * on success or -1 (leaving the machine alone) if it doesn't fit */
+int nes_load_state_buf (nes *n, byte *buf, size_t size) {
+  stream s = {buf, 12, size, 1};
+  uint32_t version, total;
+
+  if (size < 12 || memcmp(buf, "NESS", 4)) {
+    fprintf(stderr, "Not a save state.\n");
+    return -1;
+  }
+  memcpy(&version, buf + 4, 4);
+  memcpy(&total, buf + 8, 4);
+  if (version != STATE_VERSION) {
+    fprintf(stderr, "Save state is version %u, we need %d.\n",
+            version, STATE_VERSION);
+    return -1;
+  }
+  if (total != size || total != nes_state_size(n)) {
+    fprintf(stderr, "Save state is for a different cartridge.\n");
+    return -1;
+  }
+  state_io(n, &s);
+
+  /* rebuild what isn't saved */
+  n->mapper.sync(n);
+  cpu_forget_code(n);
+  memset(n->p->chr_dirty, 1, sizeof(n->p->chr_dirty));
+  n->p->oam_dirty = 1;
+  ppu_catch_up(n);
+  /* the sound carries on from the new clock */
+  n->a->buf_clock = n->a->clock;
+  n->a->buf_offset = 0;
+  apu_catch_up(n);
+  return 0;
+}
+
+int nes_save_state (nes *n, char *file) {
+  size_t size = nes_state_size(n);
+  byte *buf = malloc(size);
+  FILE *out = fopen(file, "wb");
+  int ok;
+
+  if (!out) {
+    fprintf(stderr, "Could not open state file '%s'.\n", file);
+    free(buf);
+    return -1;
+  }
+  nes_save_state_buf(n, buf, size);
+  ok = fwrite(buf, 1, size, out) == size;
+  fclose(out);
+  free(buf);
+  return ok ? 0 : -1;
+}
+
+int nes_load_state (nes *n, char *file) {
+  FILE *in = fopen(file, "rb");
+  byte *buf;
+  long size;
+  int r;
+
+  if (!in) {
+    fprintf(stderr, "Could not open state file '%s'.\n", file);
+    return -1;
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  rewind(in);
+  buf = malloc(size > 0 ? size : 1);
+  if (fread(buf, 1, size, in) != (size_t)size) {
+    fprintf(stderr, "Could not read state file '%s'.\n", file);
+    r = -1;
+  } else {
+    r = nes_load_state_buf(n, buf, size);
+  }
+  fclose(in);
+  free(buf);
+  return r;
+}
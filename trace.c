@@ -0,0 +1,178 @@
+/* 
+ * trace.c
+ * by Max Willsey
+ * a cheap instruction trace, written out in the same format as nestest.log
+ * or checked against a log like it as it runs
+ */
+
+#include "nes.h"
+
+/* size is rounded up to a power of 2 */
+void trace_init (trace *t, int size, FILE *out) {
+  t->size = 1;
+  while (t->size < (uint64_t)size)
+    t->size <<= 1;
+  t->entries = malloc(sizeof(trace_entry) * t->size);
+  t->count = 0;
+  t->flushed = 0;
+  t->out = out;
+  t->expect = NULL;
+  t->lines = t->matched = 0;
+  t->scanline = 0;
+  t->done = t->failed = 0;
+}
+
+/* PC and opcode, then the registers starting at column 48 like nestest.log.
+ * the ppu dot and scanline come from the cycle count, since the ppu runs
+ * 341 dots a line and 262 lines a frame (261 is shown as -1) */
+static void trace_print (trace *t, trace_entry *e, FILE *f) {
+  uint64_t dot = e->cycle * 3;
+  int scanline = (dot / 341 + t->scanline) % 262;
+  fprintf(f, "%04X  %02X %39sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d SL:%d\n",
+          e->PC, e->op, "", e->A, e->X, e->Y, e->P, e->SP,
+          (int)(dot % 341), scanline == 261 ? -1 : scanline);
+}
+
+/* check every instruction against the first lines of log (all of it if
+ * lines is 0) as it's recorded, from before anything's been recorded. The
+ * log can start on any scanline, ours are counted from its first line */
+void trace_expect (trace *t, FILE *log, uint64_t lines) {
+  t->expect = log;
+  t->lines = lines;
+  t->matched = 0;
+  t->done = t->failed = 0;
+}
+
+/* read the value after label at *s into v, in hex if digits is set or
+ * decimal if it's 0, moving *s past it. -1 if it isn't there */
+static int field (char **s, char *label, int digits, int *v) {
+  int len = strlen(label), d;
+  char *end;
+  while (**s == ' ')
+    (*s)++;
+  if (strncmp(*s, label, len))
+    return -1;
+  *s += len;
+  if (!digits) {
+    *v = strtol(*s, &end, 10);
+    if (end == *s)
+      return -1;
+    *s = end;
+    return 0;
+  }
+  for (*v = 0; digits; digits--, (*s)++) {
+    d = **s;
+    if (d >= '0' && d <= '9')
+      *v = *v << 4 | (d - '0');
+    else if ((d | 0x20) >= 'a' && (d | 0x20) <= 'f')
+      *v = *v << 4 | ((d | 0x20) - 'a' + 10);
+    else
+      return -1;
+  }
+  return 0;
+}
+
+/* pull the PC, opcode and registers out of a line of nestest.log. This
+ * runs for every instruction, so it reads the fields by hand */
+static int parse_line (char *line, trace_entry *e, int *dot, int *scanline) {
+  char *s = line;
+  int pc, op, a, x, y, p, sp;
+  if (strlen(line) < 48 || field(&s, "", 4, &pc) || field(&s, "", 2, &op))
+    return -1;
+  s = line + 48;
+  if (field(&s, "A:", 2, &a) || field(&s, "X:", 2, &x) ||
+      field(&s, "Y:", 2, &y) || field(&s, "P:", 2, &p) ||
+      field(&s, "SP:", 2, &sp) || field(&s, "CYC:", 0, dot) ||
+      field(&s, "SL:", 0, scanline))
+    return -1;
+  e->PC = pc;
+  e->op = op;
+  e->A = a;
+  e->X = x;
+  e->Y = y;
+  e->P = p;
+  e->SP = sp;
+  /* the pre-render line is shown as -1 */
+  if (*scanline < 0)
+    *scanline += 262;
+  return 0;
+}
+
+static void diff (char *name, int want, int got, int width) {
+  if (want != got)
+    printf("  %-3s expected %0*X, got %0*X\n", name, width, want, width, got);
+}
+
+/* the instruction that was just recorded has to match the next line of
+ * the log. On the first one that doesn't, show the last few instructions
+ * and what's different */
+void trace_check (trace *t, trace_entry *e) {
+  char line[512];
+  trace_entry want;
+  int dot, scanline, our_dot, our_scanline;
+  uint64_t i;
+
+  if (t->done || t->failed)
+    return;
+  if (!fgets(line, sizeof(line), t->expect)) {
+    t->done = 1;
+    return;
+  }
+  if (parse_line(line, &want, &dot, &scanline)) {
+    printf("Line %llu of the log isn't an instruction:\n%s",
+           (unsigned long long) t->count, line);
+    t->failed = 1;
+    return;
+  }
+  our_dot = e->cycle * 3 % 341;
+  our_scanline = e->cycle * 3 / 341 % 262;
+  if (t->count == 1)
+    t->scanline = (scanline - our_scanline + 262) % 262;
+  our_scanline = (our_scanline + t->scanline) % 262;
+
+  if (want.PC != e->PC || want.op != e->op || want.A != e->A ||
+      want.X != e->X || want.Y != e->Y || want.P != e->P ||
+      want.SP != e->SP || dot != our_dot || scanline != our_scanline) {
+    printf("Instruction %llu doesn't match the log. Before it:\n",
+           (unsigned long long) t->count);
+    i = t->count > 5 ? t->count - 5 : 0;
+    for (; i < t->count - 1; i++)
+      trace_print(t, &t->entries[i & (t->size - 1)], stdout);
+    printf("expected:\n%s", line);
+    diff("PC", want.PC, e->PC, 4);
+    diff("op", want.op, e->op, 2);
+    diff("A", want.A, e->A, 2);
+    diff("X", want.X, e->X, 2);
+    diff("Y", want.Y, e->Y, 2);
+    diff("P", want.P, e->P, 2);
+    diff("SP", want.SP, e->SP, 2);
+    if (dot != our_dot)
+      printf("  CYC expected %d, got %d\n", dot, our_dot);
+    if (scanline != our_scanline)
+      printf("  SL  expected %d, got %d\n", scanline, our_scanline);
+    t->failed = 1;
+    return;
+  }
+  if (++t->matched == t->lines)
+    t->done = 1;
+}
+
+/* write out everything recorded since the last flush */
+void trace_flush (trace *t) {
+  if (!t->out)
+    return;
+  for (; t->flushed < t->count; t->flushed++)
+    trace_print(t, &t->entries[t->flushed & (t->size - 1)], t->out);
+}
+
+/* write out whatever is still in the ring, handy after a crash */
+void trace_dump (trace *t, FILE *f) {
+  uint64_t i = t->count > t->size ? t->count - t->size : 0;
+  for (; i < t->count; i++)
+    trace_print(t, &t->entries[i & (t->size - 1)], f);
+}
+
+void trace_destroy (trace *t) {
+  trace_flush(t);
+  free(t->entries);
+}